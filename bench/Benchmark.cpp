@@ -0,0 +1,418 @@
+/*
+ * File name: Benchmark.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Benchmark.h"
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <thread>
+#include <unistd.h>
+#include "XWPWindow.h"
+#include "KLoggeg.h"
+
+static const int LOGGER_MESSAGES = 20000;
+static const int X_ITERATIONS = 50;
+static const int PLAYER_RUNS = 5;
+static const int FANOUT_BUFFERS = 300;
+static const int CLIP_FRAMES = 90;
+static const guint SCALING_TIMEOUT = 60; // s
+static const gint64 FIRST_BUFFER_TIMEOUT = 5 * G_USEC_PER_SEC;
+
+static gint64 cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+           + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static double residentKiB() {
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+bool Benchmark::run(const BenchmarkSettings& settings) {
+    std::vector<BenchmarkResult> results;
+
+    unsigned int threads = std::max(2u, std::thread::hardware_concurrency());
+    results.push_back({"logger_1_thread", loggerThroughput(1), "ns/msg"});
+    results.push_back({"logger_" + std::to_string(threads) + "_threads", loggerThroughput(threads), "ns/msg"});
+
+    if (XrandrManager::initialize()) {
+        results.push_back({"xrandr_update_monitors", monitorUpdateLatency(), "us"});
+        results.push_back({"xwpwindow_create", windowCreateLatency(), "us"});
+        for (int count : { 1, 4, 16 }) {
+            results.push_back({"x11_startup_" + std::to_string(count), startupRoundTrips(count), "round trips"});
+        }
+    } else {
+        warning("Benchmark") << "No X display, skipping X11 benchmarks";
+    }
+
+    std::string clip = generateClip();
+    double initTime, firstBuffer;
+    if (!clip.empty() && playerStartup(clip, initTime, firstBuffer)) {
+        results.push_back({"player_init", initTime, "us"});
+        results.push_back({"player_first_buffer", firstBuffer, "us"});
+    } else {
+        warning("Benchmark") << "No usable test clip, skipping player benchmarks";
+    }
+    for (int monitors : { 1, 4, 8, 16 }) {
+        double cpuPerFrame, rss;
+        if (!clip.empty() && offscreenScaling(clip, monitors, cpuPerFrame, rss)) {
+            results.push_back({"offscreen_" + std::to_string(monitors) + "_cpu", cpuPerFrame, "us/frame"});
+            results.push_back({"offscreen_" + std::to_string(monitors) + "_rss", rss, "KiB"});
+        }
+    }
+    if (!clip.empty()) {
+        g_remove(clip.data());
+    }
+
+    for (int branches : { 1, 2, 4, 8, 16 }) {
+        double perBuffer = teeFanout(branches);
+        if (perBuffer > 0) {
+            results.push_back({"tee_fanout_" + std::to_string(branches), perBuffer, "us/buffer"});
+        }
+    }
+
+    for (const auto& result : results) {
+        info("Benchmark") << result.name << ": " << result.value << " " << result.unit;
+    }
+
+    bool passed = true;
+    if (!settings.baseline.empty()) {
+        std::map<std::string, double> baseline;
+        passed = loadBaseline(settings.baseline, baseline);
+
+        // A benchmark that could not run (no display, no encoder for the clip) must not pass as "no regression"
+        for (const auto& [name, value] : baseline) {
+            bool measured = std::any_of(results.begin(), results.end(),
+                                        [&name](const BenchmarkResult& result) { return result.name == name; });
+            if (!measured) {
+                error("Benchmark") << name << " is in the baseline but was not measured";
+                passed = false;
+            }
+        }
+
+        for (const auto& result : results) {
+            auto it = baseline.find(result.name);
+            if (it == baseline.end()) {
+                continue;
+            }
+            double limit = it->second * (1.0 + settings.threshold / 100.0);
+            if (result.value > limit) {
+                error("Benchmark") << result.name << " regressed: " << result.value << " " << result.unit
+                                   << " against baseline " << it->second << " (limit " << limit << ")";
+                passed = false;
+            }
+        }
+    }
+
+    if (!settings.save.empty() && !saveBaseline(settings.save, results)) {
+        passed = false;
+    }
+    return passed;
+}
+
+double Benchmark::loggerThroughput(unsigned int threads) {
+    NullBuffer null;
+    std::streambuf *stderrBuffer = std::cerr.rdbuf(&null);
+
+    gint64 start = g_get_monotonic_time();
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([threads]() {
+            for (unsigned int i = 0; i < LOGGER_MESSAGES / threads; i++) {
+                info("Benchmark") << "message " << i << " value " << 3.14;
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    std::cerr.rdbuf(stderrBuffer);
+    return elapsed * 1000.0 / LOGGER_MESSAGES;
+}
+
+double Benchmark::monitorUpdateLatency() {
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < X_ITERATIONS; i++) {
+        XrandrManager::updateMonitorInfo();
+    }
+    return static_cast<double>(g_get_monotonic_time() - start) / X_ITERATIONS;
+}
+
+double Benchmark::windowCreateLatency() {
+    MonitorInfo monitor = {"benchmark", 640, 480, 0, 0, false};
+
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < X_ITERATIONS; i++) {
+        XWPWindow window;
+        window.createWindow(monitor);
+        XSync(XrandrManager::getDisplay(), False);
+    }
+    return static_cast<double>(g_get_monotonic_time() - start) / X_ITERATIONS;
+}
+
+double Benchmark::startupRoundTrips(int count) {
+    // Same path as main with --fake-monitors: parse the layout, create every window pipelined, then a
+    // single sync. Round trips do not depend on the machine or the server's load, wall time does. The
+    // window atoms were interned by the earlier benchmarks, so this is the cost of every later start.
+    std::string layout;
+    for (int n = 0; n < count; n++) {
+        layout += std::string(n ? "," : "") + "320x240+" + std::to_string((n % 4) * 320) + "+" +
+                  std::to_string((n / 4) * 240);
+    }
+
+    unsigned long start = x11RoundTrips();
+    std::vector<MonitorInfo> monitors;
+    XrandrManager::parseLayout(layout, monitors);
+    std::vector<std::unique_ptr<XWPWindow>> windows;
+    for (auto& monitor : monitors) {
+        monitor.display = XrandrManager::getDisplay();
+        windows.push_back(std::make_unique<XWPWindow>());
+        windows.back()->createWindow(monitor);
+    }
+    XrandrManager::sync();
+    unsigned long roundTrips = x11RoundTrips() - start;
+
+    windows.clear();
+    XrandrManager::sync();
+    return roundTrips;
+}
+
+bool Benchmark::playerStartup(const std::string& clip, double& initTime, double& firstBuffer) {
+    VideoSettings settings;
+    settings.filename = clip;
+    initTime = firstBuffer = 0;
+
+    for (int run = 0; run < PLAYER_RUNS; run++) {
+        VideoPlayer player(settings);
+
+        gint64 start = g_get_monotonic_time();
+        if (!player.init()) {
+            return false;
+        }
+        initTime += g_get_monotonic_time() - start;
+
+        start = g_get_monotonic_time();
+        if (!player.start()) {
+            return false;
+        }
+        while (!player.getFirstBufferTime() && g_get_monotonic_time() - start < FIRST_BUFFER_TIMEOUT) {
+            if (!g_main_context_iteration(nullptr, FALSE)) {
+                g_usleep(100);
+            }
+        }
+        if (!player.getFirstBufferTime()) {
+            error("Benchmark") << "No buffer within " << FIRST_BUFFER_TIMEOUT / G_USEC_PER_SEC << " s";
+            return false;
+        }
+        firstBuffer += player.getFirstBufferTime() - start;
+    }
+
+    initTime /= PLAYER_RUNS;
+    firstBuffer /= PLAYER_RUNS;
+    return true;
+}
+
+double Benchmark::teeFanout(int branches) {
+    std::string description = "videotestsrc num-buffers=" + std::to_string(FANOUT_BUFFERS) +
+                              " pattern=black ! video/x-raw,width=1280,height=720 ! tee name=t";
+    for (int i = 0; i < branches; i++) {
+        description += " t. ! queue max-size-buffers=2 ! fakesink sync=false";
+    }
+
+    double elapsed;
+    if (!runPipeline(description, elapsed)) {
+        return -1;
+    }
+    return elapsed / FANOUT_BUFFERS;
+}
+
+bool Benchmark::offscreenScaling(const std::string& clip, int monitors, double& cpuPerFrame, double& rss) {
+    // The real player, branch and pacing code, unsynced and without any display
+    VideoSettings settings;
+    settings.filename = clip;
+    settings.overlay = Offscreen;
+    settings.sync = false;
+
+    std::string layout;
+    for (int n = 0; n < monitors; n++) {
+        layout += (n ? "," : "") + std::string("640x360+") + std::to_string((n % 4) * 640) + "+" +
+                  std::to_string((n / 4) * 360);
+    }
+    std::vector<MonitorInfo> layoutMonitors;
+    XrandrManager::parseLayout(layout, layoutMonitors);
+
+    VideoPlayer player(settings);
+    if (!player.init()) {
+        return false;
+    }
+    for (const auto& monitor : layoutMonitors) {
+        if (!player.addWindow(0, monitor)) {
+            return false;
+        }
+    }
+
+    double rssStart = residentKiB();
+    gint64 cpuStart = cpuTime();
+    if (!player.start()) {
+        return false;
+    }
+
+    bool timedOut = false;
+    guint timeout = g_timeout_add_seconds(SCALING_TIMEOUT, [](gpointer data) -> gboolean {
+        *static_cast<bool*>(data) = true;
+        GStreamer::quitMainLoop();
+        return G_SOURCE_REMOVE;
+    }, &timedOut);
+    GStreamer::runMainLoop();
+    if (!timedOut) {
+        g_source_remove(timeout);
+    }
+
+    // Sampled while every branch is still alive
+    cpuPerFrame = static_cast<double>(cpuTime() - cpuStart) / CLIP_FRAMES;
+    rss = residentKiB() - rssStart;
+    player.stop();
+
+    if (timedOut) {
+        error("Benchmark") << "Offscreen playback on " << monitors << " monitors did not finish";
+    }
+    return !timedOut;
+}
+
+std::string Benchmark::generateClip() {
+    gchar *location = g_build_filename(g_get_tmp_dir(), "kabegami-benchmark.mp4", nullptr);
+    std::string path = location;
+    g_free(location);
+
+    for (auto encoder : { "x264enc ! h264parse", "openh264enc ! h264parse", "avenc_mpeg4" }) {
+        std::string description = "videotestsrc num-buffers=" + std::to_string(CLIP_FRAMES) + " ! video/x-raw,width=1280,height=720,framerate=30/1 ! "
+                                  "videoconvert ! " + std::string(encoder) + " ! mp4mux ! filesink location=" + path;
+        double elapsed;
+        if (runPipeline(description, elapsed)) {
+            return path;
+        }
+    }
+    return "";
+}
+
+bool Benchmark::runPipeline(const std::string& description, double& elapsed) {
+    GError *gerror = nullptr;
+    GstElement *pipeline = gst_parse_launch(description.data(), &gerror);
+    if (!pipeline || gerror) {
+        if (gerror) {
+            g_error_free(gerror);
+        }
+        if (pipeline) {
+            gst_object_unref(pipeline);
+        }
+        return false;
+    }
+
+    gint64 start = g_get_monotonic_time();
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, 30 * GST_SECOND,
+                                                 static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    elapsed = g_get_monotonic_time() - start;
+
+    bool ok = msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (msg) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return ok;
+}
+
+bool Benchmark::loadBaseline(const std::string& path, std::map<std::string, double>& baseline) {
+    // A missing baseline fails the run, otherwise a CTest run would pass without comparing anything
+    std::ifstream in(path);
+    if (!in) {
+        error("Benchmark") << "Failed to open baseline " << path;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        double value;
+        if (line.empty() || line[0] == '#' || !(fields >> name >> value)) {
+            continue;
+        }
+        baseline[name] = value;
+    }
+    if (baseline.empty()) {
+        error("Benchmark") << "Baseline " << path << " holds no measurements, record one with --save";
+        return false;
+    }
+    return true;
+}
+
+bool Benchmark::saveBaseline(const std::string& path, const std::vector<BenchmarkResult>& results) {
+    std::ofstream out(path);
+    if (!out) {
+        error("Benchmark") << "Failed to write baseline " << path;
+        return false;
+    }
+
+    // Numbers only mean something next to the machine they were measured on
+    std::string cpu = "unknown CPU";
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    for (std::string line; std::getline(cpuinfo, line);) {
+        if (line.rfind("model name", 0) == 0 && line.find(':') != std::string::npos) {
+            cpu = line.substr(line.find(':') + 2);
+            break;
+        }
+    }
+    struct utsname system;
+    uname(&system);
+    GDateTime *now = g_date_time_new_now_utc();
+    gchar *date = g_date_time_format(now, "%Y-%m-%d");
+    gchar *gstVersion = gst_version_string();
+    out << "# Measured " << date << " on " << system.nodename << ": " << cpu << ", "
+        << std::thread::hardware_concurrency() << " threads, " << system.sysname << " " << system.release
+        << ", " << gstVersion << ", " << (g_getenv("DISPLAY") ? g_getenv("DISPLAY") : "no display") << "\n";
+    g_free(gstVersion);
+    g_free(date);
+    g_date_time_unref(now);
+
+    for (const auto& result : results) {
+        out << result.name << " " << result.value << "\n";
+    }
+    return true;
+}
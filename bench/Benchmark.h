@@ -0,0 +1,57 @@
+/*
+ * File name: Benchmark.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "VideoPlayer.h"
+#include <map>
+
+struct BenchmarkSettings {
+    std::string baseline;  // compare against this file
+    std::string save;      // store the results here
+    double threshold = 25; // percent
+};
+
+struct BenchmarkResult {
+    std::string name;
+    double value;
+    std::string unit;
+};
+
+// Times the hot paths of the player. Results can be saved as a baseline and
+// later runs fail when any of them regresses past the threshold.
+class Benchmark {
+public:
+    static bool run(const BenchmarkSettings& settings);
+
+private:
+    static double loggerThroughput(unsigned int threads);
+    static double monitorUpdateLatency();
+    static double windowCreateLatency();
+    static double startupRoundTrips(int count);
+    static bool playerStartup(const std::string& clip, double& initTime, double& firstBuffer);
+    static double teeFanout(int branches);
+    static bool offscreenScaling(const std::string& clip, int monitors, double& cpuPerFrame, double& rss);
+
+    static unsigned long x11RoundTrips();
+    static std::string generateClip();
+    static bool runPipeline(const std::string& description, double& elapsed);
+
+    static bool loadBaseline(const std::string& path, std::map<std::string, double>& baseline);
+    static bool saveBaseline(const std::string& path, const std::vector<BenchmarkResult>& results);
+};
@@ -0,0 +1,39 @@
+/*
+ * File name: RoundTrips.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Kept apart from Benchmark.cpp, it replaces a libX11 internal for the whole executable
+#include "Benchmark.h"
+#include <X11/Xproto.h>
+#include <atomic>
+#include <dlfcn.h>
+
+static std::atomic<unsigned long> replies = 0;
+
+// Every Xlib call that waits for the server goes through _XReply, libX11 calls it through its PLT,
+// so this definition in the executable sees the player code's round trips as well
+extern "C" Status _XReply(Display* display, xReply* reply, int extra, Bool discard) {
+    using ReplyFunction = Status (*)(Display*, xReply*, int, Bool);
+    static ReplyFunction next = reinterpret_cast<ReplyFunction>(dlsym(RTLD_NEXT, "_XReply"));
+    replies++;
+    return next(display, reply, extra, discard);
+}
+
+unsigned long Benchmark::x11RoundTrips() {
+    return replies;
+}
@@ -0,0 +1,102 @@
+/*
+ * File name: main.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Benchmark.h"
+#include "GStreamer.h"
+#include "KLoggeg.h"
+#include <cerrno>
+#include <cstdlib>
+#include <getopt.h>
+#include <iostream>
+
+enum BenchmarkOption {
+    BaselineOption = 256,
+    SaveOption,
+    ThresholdOption
+};
+
+void printHelp(const char* prog_name) {
+    std::cout << "Usage: " << prog_name << " [options]\n\n"
+              << "Options:\n"
+              << "      --baseline <file>    Fail when a result regresses past this baseline\n"
+              << "      --save <file>        Store the results as a new baseline\n"
+              << "      --threshold <%>      Allowed regression over the baseline (default 25)\n"
+              << "  -h, --help               Print this help message\n\n";
+}
+
+bool parseArgs(int argc, char* argv[], BenchmarkSettings& settings, bool& help) {
+    const struct option long_options[] = {
+        {"baseline", required_argument, 0, BaselineOption},
+        {"save", required_argument, 0, SaveOption},
+        {"threshold", required_argument, 0, ThresholdOption},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case BaselineOption:
+            settings.baseline = optarg;
+            break;
+        case SaveOption:
+            settings.save = optarg;
+            break;
+        case ThresholdOption: {
+            char *end = nullptr;
+            errno = 0;
+            settings.threshold = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || errno != 0 || settings.threshold < 0) {
+                std::cerr << "Threshold must be a non-negative percentage: " << optarg << "\n\n";
+                return false;
+            }
+            break;
+        }
+        case 'h':
+            printHelp(argv[0]);
+            help = true;
+            return true;
+        default:
+            printHelp(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (!GStreamer::initialize(argc, argv)) {
+        return 1;
+    }
+
+    BenchmarkSettings settings;
+    bool help = false;
+    int ret = 1;
+    if (!parseArgs(argc, argv, settings, help)) {
+        ret = 1;
+    } else if (help) {
+        ret = 0;
+    } else if (GStreamer::createMainLoop()) {
+        ret = Benchmark::run(settings) ? 0 : 1;
+    }
+
+    XrandrManager::cleanup();
+    GStreamer::cleanup();
+    return ret;
+}
@@ -0,0 +1,67 @@
+/*
+ * File name: AnimatedImage.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gst/app/gstappsrc.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "XrandrManager.h"
+
+struct AnimationFrame {
+    std::vector<uint8_t> indices; // whole canvas, one palette index per pixel
+    std::vector<uint32_t> pixels; // whole canvas BGRx instead, for frames with more than 256 colors
+    uint32_t palette[256];        // BGRx
+    guint delay;                  // ms
+};
+
+// GIF, PNG/APNG and WebP wallpapers are decoded once into palette-indexed frames
+// (BGRx where a frame has too many colors) and expanded to each monitor's size
+// while being pushed, so loops never run a decoder again.
+class AnimatedImage {
+public:
+    AnimatedImage();
+    ~AnimatedImage();
+
+    static bool isAnimatedImage(const std::string& filename);
+    static const char* unsupportedFormat(const std::string& filename); // nullptr when playable
+
+    bool load(const std::string& filename, guint64 memoryLimit);
+    GstElement* createSource(const MonitorInfo& monitor, bool loop);
+
+private:
+    struct Feed;
+
+    static void onNeedData(GstAppSrc* appsrc, guint length, gpointer data);
+
+    bool decode(const guint8* data, gsize size, guint64 memoryLimit);
+    bool decodeGif(const guint8* data, gsize size, guint64 memoryLimit);
+    bool decodePng(const guint8* data, gsize size, guint64 memoryLimit);
+    bool decodeWebp(const guint8* data, gsize size, guint64 memoryLimit);
+    bool fitsCanvas(int copies, guint64 memoryLimit) const;
+    gsize addFrame(const std::vector<uint32_t>& canvas, guint delay);
+    void expand(const AnimationFrame& frame, Feed& feed, uint32_t* out) const;
+
+private:
+    int width;
+    int height;
+    std::vector<AnimationFrame> frames;
+    std::vector<std::unique_ptr<Feed>> feeds;
+};
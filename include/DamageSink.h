@@ -0,0 +1,67 @@
+/*
+ * File name: DamageSink.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gst/app/gstappsink.h>
+#include <X11/extensions/XShm.h>
+#include <mutex>
+#include "XrandrManager.h"
+
+// Presents BGRx frames into a window through a shared XImage, uploading only
+// the tiles that changed since the previous frame. A detached branch keeps its
+// DamageSink, so the X connection survives until the branch is reattached.
+class DamageSink {
+public:
+    DamageSink(const MonitorInfo& monitor, Window window, unsigned int tileSize);
+    ~DamageSink();
+
+    bool init();
+    void attach(GstAppSink* appsink);
+
+private:
+    static GstFlowReturn onNewSample(GstAppSink* appsink, gpointer data);
+    static gboolean onEvents(gint fd, GIOCondition condition, gpointer data);
+
+    bool attachShm(Visual* visual, int depth);
+    void render(const guint8* data, int stride);
+    void repaintExposed();
+    void putImage(int x, int y, int width, int height);
+    void report();
+
+private:
+    MonitorInfo monitor;
+    Window window;
+    unsigned int tileSize;
+
+    std::mutex renderMutex; // a detached appsink may still be rendering when the new one starts
+    Display* display;
+    GC gc;
+    XImage* image;
+    XShmSegmentInfo shminfo;
+    bool useShm;
+    bool fullUpdate;
+    guint eventSource;
+
+    std::vector<bool> dirty;
+
+    guint64 frames;
+    guint64 skipped;
+    guint64 tiles;
+    guint64 updatedTiles;
+};
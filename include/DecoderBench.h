@@ -0,0 +1,40 @@
+/*
+ * File name: DecoderBench.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gst/gst.h>
+#include <map>
+#include <string>
+
+// Picks the decoder with the lowest CPU time per frame for the file's codec by
+// decoding a short sample with every candidate. Winners are cached per codec
+// and resolution class and pinned through the registry rank.
+class DecoderBench {
+public:
+    static bool select(const std::string& filename);
+
+private:
+    static GstCaps* probeCaps(const std::string& filename);
+    static double measure(const std::string& filename, const gchar* factoryName);
+
+    static std::string cacheKey(GstCaps* caps);
+    static std::string cachePath();
+    static std::map<std::string, std::string> loadCache();
+    static void saveCache(const std::map<std::string, std::string>& cache);
+};
@@ -0,0 +1,97 @@
+/*
+ * File name: FrameExporter.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Export protocol, version 1.
+ *
+ * A client connects to the SOCK_SEQPACKET Unix socket and receives one byte
+ * carrying a read-only, write-sealed memfd in SCM_RIGHTS. The memfd starts
+ * with an ExportHeader; frame slots follow at dataOffset, slotSize bytes
+ * apart. Each published frame is then announced with its 64-bit frame number
+ * in one packet; slow clients simply miss announcements, the writer never
+ * waits.
+ *
+ * Slots are guarded by a sequence lock: the slot sequence is odd while the
+ * writer fills it and 2 * (frame + 1) once frame is complete. A reader checks
+ * that the sequence is even and unchanged before and after using the slot.
+ */
+static const uint32_t EXPORT_MAGIC = 0x4d47424b; // "KBGM"
+static const uint32_t EXPORT_VERSION = 1;
+static const uint32_t EXPORT_MAX_SLOTS = 8;
+
+struct ExportSlot {
+    std::atomic<uint64_t> sequence;
+    uint64_t pts;
+};
+
+struct ExportHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format; // GST_MAKE_FOURCC('B', 'G', 'R', 'x')
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t slotSize;
+    uint64_t dataOffset;
+    std::atomic<uint64_t> latest; // newest complete frame + 1, 0 before the first one
+    ExportSlot slot[EXPORT_MAX_SLOTS];
+};
+
+class FrameExporter {
+public:
+    FrameExporter(const std::string& socketPath);
+    ~FrameExporter();
+
+    bool init();
+    void attach(GstAppSink* appsink);
+
+private:
+    static gboolean onAccept(gint fd, GIOCondition condition, gpointer data);
+    static GstFlowReturn onNewSample(GstAppSink* appsink, gpointer data);
+
+    bool createBuffer(const GstVideoInfo& videoInfo);
+    void publish(const GstVideoFrame& frame);
+    void sendDescriptor(int client);
+
+private:
+    std::string socketPath;
+    int listenFd;
+    guint acceptSource;
+
+    int memfd;
+    int readOnlyFd; // what clients receive
+    guint8* mapping;
+    size_t mappingSize;
+    ExportHeader* header;
+    uint64_t frames;
+
+    std::mutex mutex;
+    std::vector<int> clients;
+};
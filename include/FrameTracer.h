@@ -0,0 +1,40 @@
+/*
+ * File name: FrameTracer.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gst/gst.h>
+#include <string>
+
+// Records every buffer crossing a pad of the attached elements into per-thread
+// rings and writes them out as a Chrome trace-event file.
+class FrameTracer {
+public:
+    static void enable(const std::string& path);
+    static bool isEnabled();
+    static void attach(GstElement* element);
+    static bool write();
+
+private:
+    static void attachPad(GstElement* element, GstPad* pad);
+    static void onPadAdded(GstElement* element, GstPad* pad, gpointer data);
+    static GstPadProbeReturn onBuffer(GstPad* pad, GstPadProbeInfo* info, gpointer data);
+
+private:
+    static std::string path;
+};
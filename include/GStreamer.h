@@ -23,13 +23,15 @@
 
 #pragma once
 #include <gst/gst.h>
+#include <string>
 
 enum DecoderType {
     Default = 0,
     Software,
     NVIDIA,
     VAAPI,
-    DirectX3D
+    DirectX3D,
+    AutoBench
 };
 
 class GStreamer {
@@ -37,12 +39,22 @@ public:
     static bool initialize(int argc, char* argv[]);
     static void enableDebug(int debuglevel);
     static bool blacklist(DecoderType option);
+    static bool changeRank(const char* featureName, guint rank);
+    static guint getRank(const char* featureName);
     static bool createMainLoop();
     static void runMainLoop();
     static void quitMainLoop();
     static GMainLoop* getMainLoop();
     static void cleanup();
+    static bool isRegistryWarm();
+
+private:
+    static bool setupRegistry(bool rebuild);
+    static void saveRegistryStamp();
 
 private:
     static GMainLoop* loop;
+    static std::string registryDir;
+    static std::string registryFingerprint;
+    static bool registryWarm;
 };
@@ -0,0 +1,29 @@
+/*
+ * File name: MemorySource.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "VideoPlayer.h"
+
+// Byte source that serves the whole file from a single mapping (mmap or heap),
+// so the demuxer pulls zero-copy GstMemory and loops never touch the disk.
+class MemorySource {
+public:
+    static GstElement* create(const VideoSettings& settings);
+    static IOCounters getIOCounters();
+};
@@ -0,0 +1,130 @@
+/*
+ * File name: OverlayLayer.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gst/gst.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct OverlayTile {
+    int x;
+    int y;
+    int width;
+    int height;
+    bool opaque; // copied instead of blended
+};
+
+// Premultiplied BGRA pixels of one widget, only tiles with visible pixels are kept
+struct OverlayRaster {
+    int width = 0;
+    int height = 0;
+    std::vector<uint32_t> pixels;
+    std::vector<OverlayTile> tiles;
+};
+
+enum WidgetKind {
+    ClockWidget,
+    TextWidget,
+    HostnameWidget,
+    ImageWidget,
+    FileWidget
+};
+
+struct OverlayWidget {
+    WidgetKind kind;
+    std::string argument; // clock format, text or path
+    int x = 32;
+    int y = 32;
+    bool fromRight = false;  // x is measured from the right edge, "-0" is flush right
+    bool fromBottom = false;
+    std::string content;  // main loop only, what the last queued rasterization shows
+    std::shared_ptr<const OverlayRaster> raster; // worker only
+};
+
+// Text and images drawn over the BGRx frames of each monitor. Widgets are only
+// rasterized again when their content changes, on a worker thread so the main
+// loop never waits for a renderer; streaming threads blend the cached tiles
+// straight into the frame they are about to present.
+class OverlayLayer {
+public:
+    OverlayLayer(const std::vector<std::string>& specs, guint fontSize);
+    ~OverlayLayer();
+
+    bool init();
+    void blend(guint8* data, int stride, int width, int height);
+    void report() const;
+
+private:
+    struct Placement {
+        int x;
+        int y;
+        bool fromRight;
+        bool fromBottom;
+        std::shared_ptr<const OverlayRaster> raster;
+    };
+    using Scene = std::vector<Placement>;
+
+    static gboolean onUpdate(gpointer data);
+    static bool parse(const std::string& spec, OverlayWidget& widget);
+    static bool parseOffset(const std::string& text, int& offset, bool& fromEnd);
+    static std::shared_ptr<const OverlayRaster> rasterizeImage(const std::string& path);
+    static std::shared_ptr<const OverlayRaster> createRaster(GstSample* sample);
+    static GstSample* pullSample(GstElement* pipeline, GstElement* sink);
+
+    void update();
+    void run();
+    std::string currentContent(const OverlayWidget& widget) const;
+    std::shared_ptr<const OverlayRaster> rasterize(const OverlayWidget& widget, const std::string& content);
+    std::shared_ptr<const OverlayRaster> rasterizeText(const std::string& text);
+    bool startTextPipeline();
+    void stopTextPipeline();
+
+private:
+    std::vector<std::string> specs;
+    guint fontSize; // pt
+    std::vector<OverlayWidget> widgets;
+    guint timer;
+
+    // Rasterization jobs, the newest content of each widget by index
+    std::thread worker;
+    std::mutex jobMutex;
+    std::condition_variable jobCondition;
+    std::map<size_t, std::string> jobs;
+    bool stopping;
+
+    // One text pipeline for every text widget, fed through appsrc and used only by the worker
+    GstElement *textPipeline;
+    GstElement *textSource;
+    GstElement *textSink;
+    GstClockTime textTime;
+
+    std::mutex mutex;
+    std::shared_ptr<const Scene> scene; // replaced whole under mutex, never modified
+
+    std::atomic<guint64> rasterizations;
+    std::atomic<guint64> frames;
+    std::atomic<guint64> blendTime; // ns
+};
@@ -0,0 +1,32 @@
+/*
+ * File name: Simd.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Pixel kernels used on the render path. AVX2 variants are picked at runtime,
+// SSE2 is the x86-64 baseline and everything else falls back to scalar code.
+class Simd {
+public:
+    static bool equal(const uint8_t* a, const uint8_t* b, size_t length);
+    static void expandPalette(const uint8_t* indices, const uint32_t* palette, uint32_t* out, size_t count);
+    // dst = src + dst * (255 - src.alpha) / 255, src is premultiplied BGRA
+    static void blendPremultiplied(const uint32_t* src, uint32_t* dst, size_t count);
+};
@@ -0,0 +1,58 @@
+/*
+ * File name: SoakMonitor.h
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <gst/gst.h>
+#include <vector>
+
+struct SoakSample {
+    double rss;      // KiB
+    double fds;
+    double threads;
+    double buffers;  // live GstBuffers, -1 when not tracked
+    double objects;  // live GstObjects, -1 when not tracked
+    double loopTime; // ms per loop
+};
+
+// Samples process resources once per batch of loops and fails the run when any
+// of them keeps growing past the threshold.
+class SoakMonitor {
+public:
+    SoakMonitor(guint64 loops, double threshold);
+    ~SoakMonitor();
+
+    bool init();
+    bool onLoop();
+    bool report() const;
+
+private:
+    SoakSample sample(double loopTime) const;
+    void countLiveObjects(double& buffers, double& objects) const;
+
+private:
+    guint64 loops;
+    guint64 completed;
+    guint64 interval;
+    double threshold;
+
+    GstTracer* tracer;
+    gint64 batchStart;
+
+    std::vector<SoakSample> samples;
+};
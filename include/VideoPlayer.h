@@ -19,13 +19,21 @@
 
 #pragma once
 #include "GStreamer.h"
+#include "XrandrManager.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 enum OverlayType {
     X11 = 0,
     OpenGL,
     Wayland,
-    DirectX
+    DirectX,
+    XShm,
+    Offscreen
 };
 
 enum QualityType {
@@ -34,14 +42,65 @@ enum QualityType {
     low
 };
 
+enum SourceType {
+    File = 0,
+    MMap,
+    Memory
+};
+
+struct IOCounters {
+    guint64 readBytes = 0; // storage reads only, page cache hits and X socket reads are not counted
+};
+
+class DamageSink;
+
+struct Branch {
+    MonitorInfo monitor;
+    guintptr window = 0;
+    GstPad *teePad = nullptr;          // nullptr while detached
+    std::vector<GstElement*> elements; // queue first, sink last
+    GstElement *rate = nullptr;
+    std::shared_ptr<DamageSink> damage; // kept while detached, reattaching reuses its X connection
+
+    std::atomic<gint64> lastFrame = 0;
+    std::atomic<guint64> dropped = 0;  // frames the leaky queue threw away
+    guint64 framesIn = 0;              // videorate counters of detached elements
+    guint64 paced = 0;
+    guint detaches = 0;
+    gint64 detachedAt = 0;
+};
+
 struct VideoSettings {
     OverlayType overlay = X11;
     DecoderType decoder = Default;
     QualityType quality = medium;
+    SourceType source = File;
+    bool mmapPopulate = false;
+    bool mmapLock = false;
+    guint64 memoryLimit = 512; // MiB
+    guint tileSize = 64;
+    std::string exportSocket;
+    int exportWidth = 0;
+    int exportHeight = 0;
     bool loop = false;
+    bool sync = true;
+    guint64 soakLoops = 0;
+    double soakThreshold = 10; // percent
+    guint videoTrack = 0;
+    guint slideshowInterval = 0; // ms, 0 plays every frame
+    std::string trace;
+    std::string fakeMonitors;
+    std::string displays; // comma separated, empty for $DISPLAY
+    std::vector<std::string> widgets; // --widget specs, kind[:argument][@x,y]
+    guint widgetFontSize = 24; // pt
     std::string filename;
 };
 
+class AnimatedImage;
+class FrameExporter;
+class OverlayLayer;
+class SoakMonitor;
+
 class VideoPlayer {
 public:
     VideoPlayer(const VideoSettings& settings);
@@ -52,16 +111,91 @@ public:
     void stop();
 
     void setSettings(const VideoSettings& settings);
-    bool addWindow(guintptr wid);
+    bool addWindow(guintptr wid, const MonitorInfo& monitor);
+
+    gint64 getFirstBufferTime() const;
+    bool reportSoak() const;
 
 private:
     static void onNewPad(GstElement *element, GstPad *pad, GstElement *data);
+    static void onDemuxerPad(GstElement *element, GstPad *pad, gpointer data);
+    static void onDemuxerNoMorePads(GstElement *element, gpointer data);
+    static GstPadProbeReturn onDropBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+    static GstPadProbeReturn onKeyframe(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+    static GstPadProbeReturn onOverlayBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+    static GstPadProbeReturn onSectionEvent(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+    static GstPadProbeReturn onTeeBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+    static GstPadProbeReturn onBranchBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+    static GstPadProbeReturn onBranchIdle(GstPad *pad, GstPadProbeInfo *info, gpointer data);
+    static void onRemoveBranch(GstElement *pipeline, gpointer data);
+    static void onQueueOverrun(GstElement *queue, gpointer data);
+    static gboolean onWatchdog(gpointer data);
+    static GstBusSyncReply onBusSync(GstBus *bus, GstMessage *msg, gpointer data);
     static gboolean onBusMessage(GstBus *bus, GstMessage *msg, gpointer data);
 
+    static const char* sinkFactory(OverlayType overlay);
+    static bool setSinkDisplay(GstElement *sink, const MonitorInfo& monitor);
+
+    bool initAnimation();
+    bool initOverlay();
+    void addOverlay(GstElement *sink);
+    bool addDecodeSection();
+    void addBusWatch();
+    bool seek(gint64 position, GstSeekFlags extra = GST_SEEK_FLAG_NONE);
+    bool recover();
+    void resume();
+    void restoreDecoders();
+    void reportRecoveries();
+    void setKeyframeSpacing(GstClockTime spacing);
+    bool addExporter();
+    bool attachBranch(Branch& branch);
+    bool attachAnimationBranch(Branch& branch);
+    void detachBranch(Branch& branch);
+    void reportBranches();
+
 private:
     VideoSettings settings;
 
     GMainLoop  *loop;
 
     GstElement *pipeline;
+    GstElement *demuxer;
+    GstElement *decoder;
+
+    guint videoPads;
+
+    IOCounters loopIO;
+
+    gdouble rate;
+    bool slideshowStarted;
+    GstClockTime lastKeyframe;
+    bool spacingMeasured;
+
+    std::atomic<gint64> firstBufferTime;
+    std::atomic<gint64> lastFrameTime;
+    guint watchdog;
+
+    // Decode section recovery, the section pointers are swapped under recoveryMutex
+    GstElement *source;
+    GstElement *converter;
+    std::mutex recoveryMutex;
+    std::string failedDecoder;               // factory of the decoder that posted the error
+    std::atomic<bool> recovering;            // from the first error until the rebuilt section is back in position
+    std::atomic<bool> resumeRequested;
+    std::atomic<guint> section;              // generation, bumped for every rebuilt section
+    std::map<std::string, guint> demotedDecoders; // failed decoder factories and their original ranks
+    std::atomic<gint64> recoveryStart;
+    std::atomic<GstClockTime> lastPosition;  // PTS of the last frame that reached the tee
+    guint failures;
+    guint attempts;                          // within RECOVERY_WINDOW
+    guint recoveries;
+    gint64 lastFailure;
+    gint64 recoveryTime;                     // total, for the mean
+    gint64 longestRecovery;
+
+    std::vector<std::unique_ptr<Branch>> branches;
+    std::unique_ptr<AnimatedImage> animation;
+    std::unique_ptr<FrameExporter> exporter;
+    std::unique_ptr<OverlayLayer> overlay;
+    std::unique_ptr<SoakMonitor> soak;
 };
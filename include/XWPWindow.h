@@ -20,8 +20,18 @@
 #pragma once
 
 #include <X11/Xatom.h>
+#include <map>
 #include "XrandrManager.h"
 
+struct WindowAtoms {
+    Atom state;
+    Atom stateBelow;
+    Atom stateSkipPager;
+    Atom windowType;
+    Atom windowTypeDesktop;
+    Atom motifHints;
+};
+
 class XWPWindow {
 public:
     XWPWindow();
@@ -31,7 +41,11 @@ public:
     Window getWindow() const;
 
 private:
+    Display* display;
     Window win;
 
     void destroyWindow();
+
+    static const WindowAtoms& getAtoms(Display* display);
+    static std::map<Display*, WindowAtoms> atoms;
 };
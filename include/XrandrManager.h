@@ -20,6 +20,7 @@
 #pragma once
 #include <X11/Xlib.h>
 #include <X11/extensions/Xrandr.h>
+#include <map>
 #include <vector>
 #include <string>
 
@@ -30,21 +31,38 @@ struct MonitorInfo {
     int x;
     int y;
     bool primary;
+    double refreshRate = 0; // Hz, 0 when the mode is unknown
+    Display* display = nullptr; // X display the monitor belongs to, nullptr for the offscreen layout
 };
 
 class XrandrManager {
 public:
-    static bool initialize();
+    static bool initialize(const std::string& fakeMonitors = "", const std::string& displayNames = "");
     static void cleanup();
     static Display* getDisplay() { return display; }
     static Window getRoot() { return root; }
     static std::vector<MonitorInfo> getMonitors();
     static MonitorInfo getPrimaryMonitor();
+    static void updateMonitorInfo();
+    static void sync();
+    static bool parseLayout(const std::string& layout, std::vector<MonitorInfo>& result);
 
 private:
-    static Display* display;
+    struct Connection {
+        Display* display;
+        bool hasMonitors; // RandR 1.5
+        Time resourcesTimestamp = 0;             // of the configuration refreshRates belong to
+        std::map<RROutput, double> refreshRates; // Hz by output, all CRTCs are queried in one batch
+    };
+
+    static Display* display; // first of connections, used where only one display makes sense
     static Window root;
+    static std::vector<Connection> connections;
+    static bool fake;
+
+    static bool openDisplay(const char* name);
+    static void updateFromMonitors(Connection& connection);
+    static void updateFromResources(Display* display);
 
-    static void updateMonitorInfo();
     static std::vector<MonitorInfo> monitors;
 };
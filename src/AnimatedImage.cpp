@@ -0,0 +1,974 @@
+/*
+ * File name: AnimatedImage.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "AnimatedImage.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <zlib.h>
+#include "Simd.h"
+#include "KLoggeg.h"
+
+#ifdef HAVE_WEBP
+#include <webp/decode.h>
+#include <webp/demux.h>
+#endif
+
+static const int MAX_CANVAS = 8192;
+static const guint DEFAULT_DELAY = 100;  // ms, what browsers use for delays of 10 ms or less
+static const uint32_t BLACK = 0xff000000;
+static const int LZW_MAX_CODES = 4096;
+
+struct AnimatedImage::Feed {
+    AnimatedImage *image;
+    int width;
+    int height;
+    bool loop;
+    size_t frame = 0;
+    GstClockTime pts = 0;
+    std::vector<int> columns;  // canvas column for every output column
+    std::vector<uint8_t> row;  // scaled indices of the row being expanded
+};
+
+struct GifReader {
+    const guint8 *data;
+    gsize size;
+    gsize pos = 0;
+    bool ok = true;
+
+    const guint8* take(gsize count) {
+        if (!ok || size - pos < count) {
+            ok = false;
+            return nullptr;
+        }
+        const guint8 *result = data + pos;
+        pos += count;
+        return result;
+    }
+
+    guint8 byte() {
+        const guint8 *value = take(1);
+        return value ? *value : 0;
+    }
+
+    guint16 word() {
+        const guint8 *value = take(2);
+        return value ? value[0] | value[1] << 8 : 0;
+    }
+
+    // Data sub-blocks: a length byte, that many bytes, until a zero length
+    void blocks(std::vector<guint8>* out) {
+        for (guint8 length = byte(); ok && length; length = byte()) {
+            const guint8 *block = take(length);
+            if (block && out) {
+                out->insert(out->end(), block, block + length);
+            }
+        }
+    }
+
+    void palette(int count, uint32_t* colors) {
+        std::fill(colors, colors + 256, BLACK);
+        const guint8 *rgb = take(count * 3);
+        for (int i = 0; rgb && i < count; i++) {
+            colors[i] = BLACK | rgb[i * 3] << 16 | rgb[i * 3 + 1] << 8 | rgb[i * 3 + 2];
+        }
+    }
+};
+
+// Maps composed BGRx colors back to one frame's palette
+struct ColorIndex {
+    static const int SLOTS = 1024;
+    uint32_t keys[SLOTS];
+    int16_t values[SLOTS];
+    int colors = 0;
+    int cached = 0;
+
+    ColorIndex() {
+        std::fill(values, values + SLOTS, -1);
+    }
+
+    // -1 once a 257th color shows up, the frame is then kept as BGRx
+    int find(uint32_t color, uint32_t* palette) {
+        guint slot = (color * 2654435761u) >> 22;
+        for (int probe = 0; probe < SLOTS; probe++, slot = (slot + 1) & (SLOTS - 1)) {
+            if (values[slot] < 0) {
+                break;
+            }
+            if (keys[slot] == color) {
+                return values[slot];
+            }
+        }
+
+        if (colors == 256) {
+            return -1;
+        }
+        int index = colors++;
+        palette[index] = color;
+        if (cached < SLOTS / 2 && values[slot] < 0) {
+            keys[slot] = color;
+            values[slot] = index;
+            cached++;
+        }
+        return index;
+    }
+};
+
+static bool decodeLzw(const std::vector<guint8>& data, int minCodeSize, std::vector<guint8>& out) {
+    if (minCodeSize < 1 || minCodeSize > 8) {
+        return false;
+    }
+
+    const int clear = 1 << minCodeSize;
+    const int end = clear + 1;
+    guint16 prefix[LZW_MAX_CODES];
+    guint8 suffix[LZW_MAX_CODES];
+    guint8 stack[LZW_MAX_CODES + 1];
+    for (int i = 0; i < clear; i++) {
+        prefix[i] = 0;
+        suffix[i] = i;
+    }
+
+    int codeSize = minCodeSize + 1;
+    int next = end + 1;
+    int previous = -1;
+    guint8 first = 0;
+    guint32 bits = 0;
+    int bitCount = 0;
+    gsize pos = 0, written = 0;
+
+    while (written < out.size()) {
+        while (bitCount < codeSize) {
+            if (pos >= data.size()) {
+                return true; // truncated frame, the rest stays at index 0
+            }
+            bits |= static_cast<guint32>(data[pos++]) << bitCount;
+            bitCount += 8;
+        }
+        int code = bits & ((1 << codeSize) - 1);
+        bits >>= codeSize;
+        bitCount -= codeSize;
+
+        if (code == clear) {
+            codeSize = minCodeSize + 1;
+            next = end + 1;
+            previous = -1;
+            continue;
+        }
+        if (code == end) {
+            break;
+        }
+        if (previous < 0) {
+            if (code >= clear) {
+                return false;
+            }
+            out[written++] = code;
+            first = code;
+            previous = code;
+            continue;
+        }
+
+        int current = code;
+        int top = 0;
+        if (code >= next) {
+            if (code > next) {
+                return false;
+            }
+            stack[top++] = first;
+            code = previous;
+        }
+        // Prefixes always point at lower codes, so the chain ends below the clear code
+        while (code >= clear) {
+            stack[top++] = suffix[code];
+            code = prefix[code];
+        }
+        first = code;
+        stack[top++] = first;
+
+        if (next < LZW_MAX_CODES) {
+            prefix[next] = previous;
+            suffix[next] = first;
+            next++;
+            if (next == (1 << codeSize) && codeSize < 12) {
+                codeSize++;
+            }
+        }
+        previous = current;
+
+        while (top > 0 && written < out.size()) {
+            out[written++] = stack[--top];
+        }
+    }
+    return true;
+}
+
+// PNG and WebP frames compose in straight-alpha BGRA, the frame table holds them over black
+static uint32_t flatten(uint32_t color) {
+    guint alpha = color >> 24;
+    if (alpha == 255) {
+        return color;
+    }
+    uint32_t out = BLACK;
+    for (int shift = 0; shift < 24; shift += 8) {
+        out |= (((color >> shift) & 0xff) * alpha / 255) << shift;
+    }
+    return out;
+}
+
+static uint32_t over(uint32_t src, uint32_t dst) {
+    guint srcAlpha = src >> 24;
+    if (srcAlpha == 255 || srcAlpha == 0) {
+        return srcAlpha ? src : dst;
+    }
+    guint dstAlpha = (dst >> 24) * (255 - srcAlpha) / 255;
+    guint alpha = srcAlpha + dstAlpha;
+    uint32_t out = alpha << 24;
+    for (int shift = 0; shift < 24; shift += 8) {
+        out |= ((((src >> shift) & 0xff) * srcAlpha + ((dst >> shift) & 0xff) * dstAlpha) / alpha) << shift;
+    }
+    return out;
+}
+
+static guint32 be32(const guint8* p) {
+    return static_cast<guint32>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static guint16 be16(const guint8* p) {
+    return p[0] << 8 | p[1];
+}
+
+struct PngHeader {
+    int depth = 0;
+    int colorType = 0;
+    int channels = 0;
+    bool interlaced = false;
+    uint32_t palette[256];     // BGRA, alpha from tRNS
+    int key[3] = { -1, -1, -1 }; // tRNS color that is fully transparent, gray or RGB samples
+};
+
+// One APNG frame (or the only image of a still PNG) with its IDAT or fdAT payloads joined
+struct PngFrame {
+    guint32 width;
+    guint32 height;
+    guint32 left;
+    guint32 top;
+    guint delay;      // ms
+    guint8 dispose;   // 0 none, 1 background, 2 previous
+    guint8 blend;     // 0 source, 1 over
+    std::vector<guint8> data;
+};
+
+// 0 for combinations the PNG specification does not allow
+static int pngChannels(int colorType, int depth) {
+    bool bits16 = depth == 8 || depth == 16;
+    bool indexed = depth == 1 || depth == 2 || depth == 4 || depth == 8;
+    switch (colorType) {
+    case 0: return bits16 || indexed ? 1 : 0;
+    case 2: return bits16 ? 3 : 0;
+    case 3: return indexed ? 1 : 0;
+    case 4: return bits16 ? 2 : 0;
+    case 6: return bits16 ? 4 : 0;
+    default: return 0;
+    }
+}
+
+static gsize pngRowBytes(const PngHeader& header, gsize width) {
+    return (width * header.channels * header.depth + 7) / 8;
+}
+
+static bool unfilter(guint8* data, gsize rowBytes, gsize rows, gsize bpp) {
+    const guint8 *prior = nullptr;
+    for (gsize y = 0; y < rows; y++, data += rowBytes + 1) {
+        guint8 filter = data[0];
+        guint8 *row = data + 1;
+        for (gsize i = 0; i < rowBytes; i++) {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = prior ? prior[i] : 0;
+            int c = prior && i >= bpp ? prior[i - bpp] : 0;
+            switch (filter) {
+            case 0: break;
+            case 1: row[i] += a; break;
+            case 2: row[i] += b; break;
+            case 3: row[i] += (a + b) / 2; break;
+            case 4: {
+                int p = a + b - c;
+                int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                row[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+            default: return false;
+            }
+        }
+        prior = row;
+    }
+    return true;
+}
+
+static uint32_t pngPixel(const PngHeader& header, const guint8* row, gsize x) {
+    auto sample = [&](int channel) -> int {
+        gsize index = x * header.channels + channel;
+        if (header.depth == 8) {
+            return row[index];
+        }
+        if (header.depth == 16) {
+            return row[index * 2] << 8 | row[index * 2 + 1];
+        }
+        gsize bit = index * header.depth;
+        return (row[bit / 8] >> (8 - header.depth - bit % 8)) & ((1 << header.depth) - 1);
+    };
+    // Samples scaled to 8 bits, 16-bit ones keep their high byte
+    auto scale = [&](int value) -> uint32_t {
+        return header.depth == 16 ? value >> 8 : header.depth == 8 ? value : value * 255 / ((1 << header.depth) - 1);
+    };
+
+    switch (header.colorType) {
+    case 0: {
+        int gray = sample(0);
+        uint32_t alpha = gray == header.key[0] ? 0 : 255;
+        return alpha << 24 | scale(gray) * 0x010101;
+    }
+    case 2: {
+        int r = sample(0), g = sample(1), b = sample(2);
+        uint32_t alpha = r == header.key[0] && g == header.key[1] && b == header.key[2] ? 0 : 255;
+        return alpha << 24 | scale(r) << 16 | scale(g) << 8 | scale(b);
+    }
+    case 3:
+        return header.palette[sample(0)];
+    case 4:
+        return scale(sample(1)) << 24 | scale(sample(0)) * 0x010101;
+    default:
+        return scale(sample(3)) << 24 | scale(sample(0)) << 16 | scale(sample(1)) << 8 | scale(sample(2));
+    }
+}
+
+// Inflates one frame and undoes filtering and Adam7 interlacing into straight BGRA
+static bool decodePngImage(const PngHeader& header, const PngFrame& frame, std::vector<uint32_t>& out,
+                           guint64 memoryLimit) {
+    struct Pass { gsize x, y, xStep, yStep; };
+    static const Pass ADAM7[] = { {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+                                  {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2} };
+    static const Pass PROGRESSIVE[] = { {0, 0, 1, 1} };
+    const Pass *passes = header.interlaced ? ADAM7 : PROGRESSIVE;
+    int passCount = header.interlaced ? 7 : 1;
+
+    auto passWidth = [&](const Pass& pass) -> gsize {
+        return frame.width > pass.x ? (frame.width - pass.x + pass.xStep - 1) / pass.xStep : 0;
+    };
+    auto passHeight = [&](const Pass& pass) -> gsize {
+        return frame.height > pass.y ? (frame.height - pass.y + pass.yStep - 1) / pass.yStep : 0;
+    };
+
+    guint64 rawSize = 0;
+    for (int i = 0; i < passCount; i++) {
+        if (passWidth(passes[i]) && passHeight(passes[i])) {
+            rawSize += passHeight(passes[i]) * (pngRowBytes(header, passWidth(passes[i])) + 1);
+        }
+    }
+    if (rawSize > memoryLimit) {
+        return false;
+    }
+
+    std::vector<guint8> raw(rawSize);
+    uLongf inflated = raw.size();
+    if (uncompress(raw.data(), &inflated, frame.data.data(), frame.data.size()) != Z_OK || inflated != raw.size()) {
+        return false;
+    }
+
+    out.assign(static_cast<gsize>(frame.width) * frame.height, 0);
+    gsize bpp = std::max(1, header.channels * header.depth / 8);
+    guint8 *data = raw.data();
+    for (int i = 0; i < passCount; i++) {
+        const Pass& pass = passes[i];
+        gsize columns = passWidth(pass), rows = passHeight(pass);
+        if (!columns || !rows) {
+            continue;
+        }
+        gsize rowBytes = pngRowBytes(header, columns);
+        if (!unfilter(data, rowBytes, rows, bpp)) {
+            return false;
+        }
+        for (gsize y = 0; y < rows; y++, data += rowBytes + 1) {
+            uint32_t *dst = out.data() + (pass.y + y * pass.yStep) * frame.width + pass.x;
+            for (gsize x = 0; x < columns; x++) {
+                dst[x * pass.xStep] = pngPixel(header, data + 1, x);
+            }
+        }
+    }
+    return true;
+}
+
+AnimatedImage::AnimatedImage() : width(0), height(0) {}
+
+AnimatedImage::~AnimatedImage() = default;
+
+static bool isGif(const guint8* magic) {
+    return std::memcmp(magic, "GIF87a", 6) == 0 || std::memcmp(magic, "GIF89a", 6) == 0;
+}
+
+static bool isPng(const guint8* magic) {
+    return std::memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0;
+}
+
+static bool isWebp(const guint8* magic) {
+    return std::memcmp(magic, "RIFF", 4) == 0 && std::memcmp(magic + 8, "WEBP", 4) == 0;
+}
+
+static void readMagic(const std::string& filename, guint8 (&magic)[12]) {
+    std::ifstream file(filename, std::ios::binary);
+    file.read(reinterpret_cast<char*>(magic), sizeof(magic));
+}
+
+// Still PNG and WebP files take the same path, they are just a one-frame table
+bool AnimatedImage::isAnimatedImage(const std::string& filename) {
+    guint8 magic[12] = {};
+    readMagic(filename, magic);
+#ifdef HAVE_WEBP
+    return isGif(magic) || isPng(magic) || isWebp(magic);
+#else
+    return isGif(magic) || isPng(magic);
+#endif
+}
+
+// Images the ISO-BMFF demuxer would only fail on with an unhelpful "not-negotiated"
+const char* AnimatedImage::unsupportedFormat(const std::string& filename) {
+#ifdef HAVE_WEBP
+    (void)filename;
+    return nullptr;
+#else
+    guint8 magic[12] = {};
+    readMagic(filename, magic);
+    return isWebp(magic) ? "WebP (built without libwebp)" : nullptr;
+#endif
+}
+
+bool AnimatedImage::load(const std::string& filename, guint64 memoryLimit) {
+    gchar *contents = nullptr;
+    gsize size = 0;
+    GError *gerror = nullptr;
+    if (!g_file_get_contents(filename.data(), &contents, &size, &gerror)) {
+        error("AnimatedImage") << "Failed to read " << filename << ": " << gerror->message;
+        g_error_free(gerror);
+        return false;
+    }
+
+    gint64 start = g_get_monotonic_time();
+    bool decoded = decode(reinterpret_cast<const guint8*>(contents), size, memoryLimit * 1024 * 1024);
+    g_free(contents);
+    if (!decoded) {
+        return false;
+    }
+
+    gsize bytes = 0;
+    guint duration = 0;
+    for (const auto& frame : frames) {
+        bytes += frame.indices.size() + frame.pixels.size() * sizeof(uint32_t) + sizeof(frame.palette);
+        duration += frame.delay;
+    }
+    info("AnimatedImage") << width << "x" << height << ", " << frames.size() << " frames, " << duration << " ms, "
+                          << bytes / 1024 << " KiB (" << 100 * bytes / (frames.size() * width * height * 4)
+                          << "% of BGRx), decoded in " << (g_get_monotonic_time() - start) / 1000 << " ms";
+    return true;
+}
+
+bool AnimatedImage::decode(const guint8* data, gsize size, guint64 memoryLimit) {
+    if (size >= 12 && isPng(data)) {
+        return decodePng(data, size, memoryLimit);
+    }
+    if (size >= 12 && isWebp(data)) {
+        return decodeWebp(data, size, memoryLimit);
+    }
+    return decodeGif(data, size, memoryLimit);
+}
+
+// Canvas sized buffers the decoder holds besides the frame table
+bool AnimatedImage::fitsCanvas(int copies, guint64 memoryLimit) const {
+    if (width <= 0 || height <= 0 || width > MAX_CANVAS || height > MAX_CANVAS) {
+        error("AnimatedImage") << "Invalid canvas " << width << "x" << height;
+        return false;
+    }
+    if (static_cast<guint64>(width) * height * sizeof(uint32_t) * copies > memoryLimit) {
+        error("AnimatedImage") << "A " << width << "x" << height << " canvas exceeds the memory limit";
+        return false;
+    }
+    return true;
+}
+
+bool AnimatedImage::decodeGif(const guint8* data, gsize size, guint64 memoryLimit) {
+    GifReader reader = { data, size };
+    reader.take(6);
+    width = reader.word();
+    height = reader.word();
+    guint8 flags = reader.byte();
+    reader.take(2); // background color and aspect ratio
+
+    if (!reader.ok) {
+        error("AnimatedImage") << "Invalid GIF header";
+        return false;
+    }
+    // The composing canvas and the copy kept for "restore to previous" come before any frame
+    if (!fitsCanvas(2, memoryLimit)) {
+        return false;
+    }
+
+    uint32_t globalPalette[256];
+    std::fill(globalPalette, globalPalette + 256, BLACK);
+    if (flags & 0x80) {
+        reader.palette(2 << (flags & 7), globalPalette);
+    }
+
+    std::vector<uint32_t> canvas(static_cast<gsize>(width) * height, BLACK);
+    std::vector<uint32_t> saved;
+    guint delay = 0;
+    int transparent = -1;
+    int disposal = 0;
+    guint64 bytes = 0;
+
+    while (reader.ok) {
+        guint8 block = reader.byte();
+        if (!reader.ok || block == 0x3B) {
+            break;
+        }
+
+        if (block == 0x21) {
+            guint8 label = reader.byte();
+            if (label == 0xF9) {
+                guint8 length = reader.byte();
+                const guint8 *control = reader.take(length);
+                if (control && length >= 4) {
+                    disposal = (control[0] >> 2) & 7;
+                    delay = control[1] | control[2] << 8;
+                    transparent = (control[0] & 1) ? control[3] : -1;
+                }
+            }
+            reader.blocks(nullptr);
+            continue;
+        }
+
+        if (block != 0x2C) {
+            warning("AnimatedImage") << "Unknown GIF block " << static_cast<int>(block) << ", stopping";
+            break;
+        }
+
+        int left = reader.word();
+        int top = reader.word();
+        int frameWidth = reader.word();
+        int frameHeight = reader.word();
+        guint8 frameFlags = reader.byte();
+
+        uint32_t localPalette[256];
+        const uint32_t *palette = globalPalette;
+        if (frameFlags & 0x80) {
+            reader.palette(2 << (frameFlags & 7), localPalette);
+            palette = localPalette;
+        }
+
+        // Checked before the frame buffer is sized from these header words
+        if (!reader.ok || frameWidth == 0 || frameHeight == 0 || left + frameWidth > width ||
+            top + frameHeight > height) {
+            warning("AnimatedImage") << "Frame " << frames.size() << " (" << frameWidth << "x" << frameHeight << "+"
+                                     << left << "+" << top << ") is outside the " << width << "x" << height
+                                     << " canvas, stopping";
+            break;
+        }
+
+        int minCodeSize = reader.byte();
+        std::vector<guint8> compressed;
+        reader.blocks(&compressed);
+
+        std::vector<guint8> pixels(static_cast<gsize>(frameWidth) * frameHeight, 0);
+        if (!reader.ok || !decodeLzw(compressed, minCodeSize, pixels)) {
+            warning("AnimatedImage") << "Corrupt frame " << frames.size() << ", stopping";
+            break;
+        }
+
+        // Interlaced frames store rows in four passes
+        std::vector<int> rows;
+        for (auto [first, step] : { std::pair{0, 8}, std::pair{4, 8}, std::pair{2, 4}, std::pair{1, 2} }) {
+            for (int y = first; (frameFlags & 0x40) && y < frameHeight; y += step) {
+                rows.push_back(y);
+            }
+        }
+
+        if (disposal == 3) {
+            saved = canvas;
+        }
+        for (int i = 0; i < frameHeight; i++) {
+            int y = top + ((frameFlags & 0x40) ? rows[i] : i);
+            if (y >= height) {
+                continue;
+            }
+            const guint8 *src = pixels.data() + static_cast<gsize>(i) * frameWidth;
+            uint32_t *dst = canvas.data() + static_cast<gsize>(y) * width;
+            for (int x = 0; x < frameWidth && left + x < width; x++) {
+                if (src[x] != transparent) {
+                    dst[left + x] = palette[src[x]];
+                }
+            }
+        }
+
+        bytes += addFrame(canvas, delay * 10);
+        if (bytes > memoryLimit) {
+            error("AnimatedImage") << "Frame table exceeds the memory limit after " << frames.size() << " frames";
+            return false;
+        }
+
+        // Disposal prepares the canvas for the next frame
+        if (disposal == 2) {
+            for (int y = top; y < std::min(top + frameHeight, height); y++) {
+                uint32_t *row = canvas.data() + static_cast<gsize>(y) * width;
+                std::fill(row + std::min(left, width), row + std::min(left + frameWidth, width), BLACK);
+            }
+        } else if (disposal == 3 && !saved.empty()) {
+            canvas.swap(saved);
+        }
+        delay = 0;
+        transparent = -1;
+        disposal = 0;
+    }
+
+    if (frames.empty()) {
+        error("AnimatedImage") << "No frames in GIF";
+        return false;
+    }
+    return true;
+}
+
+bool AnimatedImage::decodePng(const guint8* data, gsize size, guint64 memoryLimit) {
+    PngHeader header;
+    std::fill(header.palette, header.palette + 256, BLACK);
+    PngFrame image = {};      // the IDAT image, hidden in an APNG when no fcTL precedes it
+    std::vector<PngFrame> animation;
+    bool animated = false;
+
+    for (gsize pos = 8; size - pos >= 12;) {
+        guint32 length = be32(data + pos);
+        const char *type = reinterpret_cast<const char*>(data + pos + 4);
+        const guint8 *body = data + pos + 8;
+        if (length > size - pos - 12) {
+            warning("AnimatedImage") << "Truncated PNG chunk, stopping";
+            break;
+        }
+        pos += length + 12;
+
+        if (std::memcmp(type, "IHDR", 4) == 0 && length >= 13) {
+            guint32 w = be32(body), h = be32(body + 4);
+            width = w > MAX_CANVAS ? MAX_CANVAS + 1 : w;
+            height = h > MAX_CANVAS ? MAX_CANVAS + 1 : h;
+            header.depth = body[8];
+            header.colorType = body[9];
+            header.channels = pngChannels(header.colorType, header.depth);
+            header.interlaced = body[12] == 1;
+        } else if (std::memcmp(type, "PLTE", 4) == 0) {
+            for (guint32 i = 0; i < length / 3 && i < 256; i++) {
+                header.palette[i] = BLACK | body[i * 3] << 16 | body[i * 3 + 1] << 8 | body[i * 3 + 2];
+            }
+        } else if (std::memcmp(type, "tRNS", 4) == 0) {
+            if (header.colorType == 3) {
+                for (guint32 i = 0; i < length && i < 256; i++) {
+                    header.palette[i] = (header.palette[i] & 0xffffff) | static_cast<uint32_t>(body[i]) << 24;
+                }
+            } else if (header.colorType == 0 && length >= 2) {
+                header.key[0] = be16(body);
+            } else if (header.colorType == 2 && length >= 6) {
+                header.key[0] = be16(body);
+                header.key[1] = be16(body + 2);
+                header.key[2] = be16(body + 4);
+            }
+        } else if (std::memcmp(type, "acTL", 4) == 0) {
+            animated = true;
+        } else if (std::memcmp(type, "fcTL", 4) == 0 && length >= 26) {
+            guint16 numerator = be16(body + 20), denominator = be16(body + 22);
+            animation.push_back({ be32(body + 4), be32(body + 8), be32(body + 12), be32(body + 16),
+                                  numerator * 1000u / (denominator ? denominator : 100), body[24], body[25], {} });
+        } else if (std::memcmp(type, "IDAT", 4) == 0) {
+            // IDAT after the first fcTL is also the first animation frame
+            std::vector<guint8>& target = animation.empty() ? image.data : animation.front().data;
+            target.insert(target.end(), body, body + length);
+        } else if (std::memcmp(type, "fdAT", 4) == 0 && length >= 4 && !animation.empty()) {
+            animation.back().data.insert(animation.back().data.end(), body + 4, body + length);
+        } else if (std::memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+    }
+
+    if (header.channels == 0) {
+        error("AnimatedImage") << "Invalid PNG header, color type " << header.colorType << " at "
+                               << header.depth << " bits";
+        return false;
+    }
+    // Canvas, the copy kept for "dispose to previous" and the flattened frame
+    if (!fitsCanvas(3, memoryLimit)) {
+        return false;
+    }
+    if (!animated || animation.empty()) {
+        image.width = width;
+        image.height = height;
+        animation.assign(1, std::move(image));
+    }
+
+    std::vector<uint32_t> canvas(static_cast<gsize>(width) * height, 0);
+    std::vector<uint32_t> flat(canvas.size());
+    std::vector<uint32_t> saved;
+    std::vector<uint32_t> pixels;
+    guint64 bytes = 0;
+
+    for (const PngFrame& frame : animation) {
+        if (frame.width == 0 || frame.height == 0 ||
+            static_cast<guint64>(frame.left) + frame.width > static_cast<guint64>(width) ||
+            static_cast<guint64>(frame.top) + frame.height > static_cast<guint64>(height)) {
+            warning("AnimatedImage") << "Frame " << frames.size() << " (" << frame.width << "x" << frame.height << "+"
+                                     << frame.left << "+" << frame.top << ") is outside the " << width << "x" << height
+                                     << " canvas, stopping";
+            break;
+        }
+        if (!decodePngImage(header, frame, pixels, memoryLimit)) {
+            warning("AnimatedImage") << "Corrupt frame " << frames.size() << ", stopping";
+            break;
+        }
+
+        // The first frame has nothing earlier to go back to
+        guint8 dispose = frame.dispose == 2 && frames.empty() ? 1 : frame.dispose;
+        if (dispose == 2) {
+            saved = canvas;
+        }
+        for (guint32 y = 0; y < frame.height; y++) {
+            const uint32_t *src = pixels.data() + static_cast<gsize>(y) * frame.width;
+            uint32_t *dst = canvas.data() + static_cast<gsize>(frame.top + y) * width + frame.left;
+            for (guint32 x = 0; x < frame.width; x++) {
+                dst[x] = frame.blend ? over(src[x], dst[x]) : src[x];
+            }
+        }
+        std::transform(canvas.begin(), canvas.end(), flat.begin(), flatten);
+
+        bytes += addFrame(flat, frame.delay);
+        if (bytes > memoryLimit) {
+            error("AnimatedImage") << "Frame table exceeds the memory limit after " << frames.size() << " frames";
+            return false;
+        }
+
+        if (dispose == 1) {
+            for (guint32 y = frame.top; y < frame.top + frame.height; y++) {
+                uint32_t *row = canvas.data() + static_cast<gsize>(y) * width;
+                std::fill(row + frame.left, row + frame.left + frame.width, 0);
+            }
+        } else if (dispose == 2) {
+            canvas.swap(saved);
+        }
+    }
+
+    if (frames.empty()) {
+        error("AnimatedImage") << "No frames in PNG";
+        return false;
+    }
+    return true;
+}
+
+#ifdef HAVE_WEBP
+bool AnimatedImage::decodeWebp(const guint8* data, gsize size, guint64 memoryLimit) {
+    // libwebp composes the frames itself, its canvas and previous canvas sit next to the flattened copy
+    WebPBitstreamFeatures features;
+    if (WebPGetFeatures(data, size, &features) != VP8_STATUS_OK) {
+        error("AnimatedImage") << "Invalid WebP header";
+        return false;
+    }
+    width = features.width;
+    height = features.height;
+    if (!fitsCanvas(3, memoryLimit)) {
+        return false;
+    }
+
+    WebPAnimDecoderOptions options;
+    WebPAnimDecoderOptionsInit(&options);
+    options.color_mode = MODE_bgrA; // premultiplied, so flattening over black only sets the alpha byte
+    WebPData webpData = { data, size };
+    WebPAnimDecoder *decoder = WebPAnimDecoderNew(&webpData, &options);
+    if (!decoder) {
+        error("AnimatedImage") << "Failed to create a WebP decoder";
+        return false;
+    }
+
+    std::vector<uint32_t> flat(static_cast<gsize>(width) * height);
+    guint64 bytes = 0;
+    int previous = 0;
+    while (WebPAnimDecoderHasMoreFrames(decoder)) {
+        uint8_t *buffer = nullptr;
+        int timestamp = 0;
+        if (!WebPAnimDecoderGetNext(decoder, &buffer, &timestamp)) {
+            warning("AnimatedImage") << "Corrupt frame " << frames.size() << ", stopping";
+            break;
+        }
+        std::memcpy(flat.data(), buffer, flat.size() * sizeof(uint32_t));
+        for (uint32_t& color : flat) {
+            color |= BLACK;
+        }
+
+        // Timestamps mark where each frame ends
+        bytes += addFrame(flat, timestamp - previous);
+        previous = timestamp;
+        if (bytes > memoryLimit) {
+            error("AnimatedImage") << "Frame table exceeds the memory limit after " << frames.size() << " frames";
+            WebPAnimDecoderDelete(decoder);
+            return false;
+        }
+    }
+    WebPAnimDecoderDelete(decoder);
+
+    if (frames.empty()) {
+        error("AnimatedImage") << "No frames in WebP";
+        return false;
+    }
+    return true;
+}
+#else
+bool AnimatedImage::decodeWebp(const guint8*, gsize, guint64) {
+    error("AnimatedImage") << "Built without libwebp";
+    return false;
+}
+#endif
+
+// Returns the bytes the frame table grew by
+gsize AnimatedImage::addFrame(const std::vector<uint32_t>& canvas, guint delay) {
+    AnimationFrame frame;
+    frame.indices.resize(canvas.size());
+    frame.delay = delay <= 10 ? DEFAULT_DELAY : delay;
+    std::fill(frame.palette, frame.palette + 256, BLACK);
+
+    ColorIndex colors;
+    uint32_t lastColor = canvas[0];
+    int lastIndex = colors.find(lastColor, frame.palette);
+    for (gsize i = 0; i < canvas.size(); i++) {
+        if (canvas[i] != lastColor) {
+            lastColor = canvas[i];
+            lastIndex = colors.find(lastColor, frame.palette);
+            if (lastIndex < 0) {
+                break;
+            }
+        }
+        frame.indices[i] = lastIndex;
+    }
+    // Photographic frames have more colors than a palette holds, they stay BGRx
+    if (lastIndex < 0) {
+        frame.indices.clear();
+        frame.indices.shrink_to_fit();
+        frame.pixels = canvas;
+    }
+
+    // Pauses are often stored as repeated identical frames, they become one longer frame
+    if (!frames.empty()) {
+        AnimationFrame& previous = frames.back();
+        if (previous.indices == frame.indices && previous.pixels == frame.pixels &&
+            std::memcmp(previous.palette, frame.palette, sizeof(frame.palette)) == 0) {
+            previous.delay += frame.delay;
+            return 0;
+        }
+    }
+    gsize bytes = frame.indices.size() + frame.pixels.size() * sizeof(uint32_t) + sizeof(frame.palette);
+    frames.push_back(std::move(frame));
+    return bytes;
+}
+
+GstElement* AnimatedImage::createSource(const MonitorInfo& monitor, bool loop) {
+    GstElement *source = gst_element_factory_make("appsrc", nullptr);
+    if (!source) {
+        return nullptr;
+    }
+
+    auto feed = std::make_unique<Feed>();
+    feed->image = this;
+    feed->width = monitor.width;
+    feed->height = monitor.height;
+    feed->loop = loop;
+    feed->row.resize(monitor.width);
+    for (int x = 0; x < monitor.width; x++) {
+        feed->columns.push_back(static_cast<int>(static_cast<gint64>(x) * width / monitor.width));
+    }
+
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "format", G_TYPE_STRING, "BGRx",
+                                        "width", G_TYPE_INT, monitor.width,
+                                        "height", G_TYPE_INT, monitor.height,
+                                        "framerate", GST_TYPE_FRACTION, 0, 1, NULL);
+    g_object_set(G_OBJECT(source), "caps", caps, "format", GST_FORMAT_TIME, NULL);
+    gst_caps_unref(caps);
+
+    GstAppSrcCallbacks callbacks = {};
+    callbacks.need_data = onNeedData;
+    gst_app_src_set_callbacks(GST_APP_SRC(source), &callbacks, feed.get(), nullptr);
+    feeds.push_back(std::move(feed));
+    return source;
+}
+
+void AnimatedImage::onNeedData(GstAppSrc* appsrc, guint length, gpointer data) {
+    Feed *feed = static_cast<Feed*>(data);
+    const auto& frames = feed->image->frames;
+
+    if (feed->frame == frames.size()) {
+        // A still image is pushed once and then just stays on screen
+        if (!feed->loop) {
+            gst_app_src_end_of_stream(appsrc);
+            return;
+        }
+        if (frames.size() == 1) {
+            return;
+        }
+        feed->frame = 0;
+    }
+
+    const AnimationFrame& frame = frames[feed->frame++];
+    GstBuffer *buffer = gst_buffer_new_allocate(nullptr, static_cast<gsize>(feed->width) * feed->height * 4, nullptr);
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_WRITE)) {
+        gst_buffer_unref(buffer);
+        return;
+    }
+    feed->image->expand(frame, *feed, reinterpret_cast<uint32_t*>(map.data));
+    gst_buffer_unmap(buffer, &map);
+
+    GST_BUFFER_PTS(buffer) = feed->pts;
+    GST_BUFFER_DURATION(buffer) = frame.delay * GST_MSECOND;
+    feed->pts += GST_BUFFER_DURATION(buffer);
+    gst_app_src_push_buffer(appsrc, buffer);
+}
+
+void AnimatedImage::expand(const AnimationFrame& frame, Feed& feed, uint32_t* out) const {
+    gint64 previous = -1;
+    for (int y = 0; y < feed.height; y++) {
+        uint32_t *row = out + static_cast<gsize>(y) * feed.width;
+        gint64 source = static_cast<gint64>(y) * height / feed.height * width;
+
+        // Upscaled rows repeat, they are copied instead of looked up again
+        if (source == previous) {
+            std::memcpy(row, row - feed.width, feed.width * sizeof(uint32_t));
+            continue;
+        }
+        previous = source;
+        if (!frame.pixels.empty()) {
+            const uint32_t *colors = frame.pixels.data() + source;
+            for (int x = 0; x < feed.width; x++) {
+                row[x] = colors[feed.columns[x]];
+            }
+            continue;
+        }
+        const guint8 *indices = frame.indices.data() + source;
+        for (int x = 0; x < feed.width; x++) {
+            feed.row[x] = indices[feed.columns[x]];
+        }
+        Simd::expandPalette(feed.row.data(), frame.palette, row, feed.width);
+    }
+}
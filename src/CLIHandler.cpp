@@ -18,9 +18,30 @@
  */
 
  #include "CLIHandler.h"
+ #include <cerrno>
+ #include <cstdio>
  #include <getopt.h>
  #include <map>
 
+ enum LongOption {
+     MmapPopulateOption = 256,
+     MmapLockOption,
+     MemoryLimitOption,
+     TileSizeOption,
+     TraceOption,
+     VideoTrackOption,
+     ExportSocketOption,
+     ExportSizeOption,
+     SoakOption,
+     SoakThresholdOption,
+     RebuildRegistryOption,
+     SlideshowOption,
+     FakeMonitorsOption,
+     DisplayOption,
+     WidgetOption,
+     WidgetFontSizeOption
+ };
+
  int getParam(const std::map<std::string, int>& map, const char* arg) {
      auto it = map.find(arg);
      return (it != map.end()) ? it->second : -1;
@@ -31,26 +52,52 @@ bool CLIHandler::splitArgs(const int argc, char *argv[], VideoSettings& settings
         {"X11", OverlayType::X11},
         {"OpenGL", OverlayType::OpenGL},
         {"Wayland", OverlayType::Wayland},
-        {"DirectX", OverlayType::DirectX}
+        {"DirectX", OverlayType::DirectX},
+        {"XShm", OverlayType::XShm},
+        {"Offscreen", OverlayType::Offscreen}
     };
     static const std::map<std::string, int> decoderMap = {
         {"Default", DecoderType::Default},
         {"Software", DecoderType::Software},
         {"NVIDIA", DecoderType::NVIDIA},
         {"VAAPI", DecoderType::VAAPI},
-        {"DirectX3D", DecoderType::DirectX3D}
+        {"DirectX3D", DecoderType::DirectX3D},
+        {"auto-bench", DecoderType::AutoBench}
     };
     static const std::map<std::string, int> qualityMap = {
         {"high", QualityType::high},
         {"medium", QualityType::medium},
         {"low", QualityType::low}
     };
+    static const std::map<std::string, int> sourceMap = {
+        {"File", SourceType::File},
+        {"MMap", SourceType::MMap},
+        {"Memory", SourceType::Memory}
+    };
 
     static struct option long_options[] = {
         {"overlay", required_argument, 0, 'o'},
         {"force-decoder", required_argument, 0, 'f'},
+        {"decoder", required_argument, 0, 'f'},
         {"loop", no_argument, 0, 'l'},
         {"quality", required_argument, 0, 'q'},
+        {"source", required_argument, 0, 's'},
+        {"mmap-populate", no_argument, 0, MmapPopulateOption},
+        {"mmap-lock", no_argument, 0, MmapLockOption},
+        {"memory-limit", required_argument, 0, MemoryLimitOption},
+        {"tile-size", required_argument, 0, TileSizeOption},
+        {"trace", required_argument, 0, TraceOption},
+        {"video-track", required_argument, 0, VideoTrackOption},
+        {"export-socket", required_argument, 0, ExportSocketOption},
+        {"export-size", required_argument, 0, ExportSizeOption},
+        {"soak", required_argument, 0, SoakOption},
+        {"soak-threshold", required_argument, 0, SoakThresholdOption},
+        {"rebuild-registry", no_argument, 0, RebuildRegistryOption},
+        {"slideshow", required_argument, 0, SlideshowOption},
+        {"fake-monitors", required_argument, 0, FakeMonitorsOption},
+        {"display", required_argument, 0, DisplayOption},
+        {"widget", required_argument, 0, WidgetOption},
+        {"widget-font-size", required_argument, 0, WidgetFontSizeOption},
         {"gst-debug-level", required_argument, 0, 'd'},
         {"version", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
@@ -60,7 +107,7 @@ bool CLIHandler::splitArgs(const int argc, char *argv[], VideoSettings& settings
     int opt;
     int option_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "o:f:lq:d:vh", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "o:f:lq:s:d:vh", long_options, &option_index)) != -1) {
         int ret;
         switch (opt) {
         case 'o':
@@ -84,6 +131,84 @@ bool CLIHandler::splitArgs(const int argc, char *argv[], VideoSettings& settings
             }
             settings.quality = (QualityType)ret;
             break;
+        case 's':
+            if ((ret = getParam(sourceMap, optarg)) == -1) {
+                std::cerr << "Missing option for -s: " << optarg << "\n\n";
+                return false;
+            }
+            settings.source = (SourceType)ret;
+            break;
+        case MmapPopulateOption:
+            settings.mmapPopulate = true;
+            break;
+        case MmapLockOption:
+            settings.mmapLock = true;
+            break;
+        case MemoryLimitOption: {
+            char *end = nullptr;
+            errno = 0;
+            guint64 limit = strtoull(optarg, &end, 10);
+            // Used in bytes later, so the MiB value must still fit after shifting it up
+            if (!g_ascii_isdigit(optarg[0]) || *end != '\0' || errno != 0 || limit == 0 || limit > G_MAXUINT64 >> 20) {
+                std::cerr << "Memory limit must be a positive number of MiB: " << optarg << "\n\n";
+                return false;
+            }
+            settings.memoryLimit = limit;
+            break;
+        }
+        case TileSizeOption:
+            if ((ret = atoi(optarg)) < 8) {
+                std::cerr << "Tile size must be at least 8: " << optarg << "\n\n";
+                return false;
+            }
+            settings.tileSize = ret;
+            break;
+        case TraceOption:
+            settings.trace = optarg;
+            break;
+        case VideoTrackOption: {
+            char *end = nullptr;
+            errno = 0;
+            unsigned long track = strtoul(optarg, &end, 10);
+            // strtoul quietly wraps a minus sign around, so it is refused up front
+            if (!g_ascii_isdigit(optarg[0]) || *end != '\0' || errno != 0 || track > G_MAXUINT) {
+                std::cerr << "Video track must be a track number: " << optarg << "\n\n";
+                return false;
+            }
+            settings.videoTrack = track;
+            break;
+        }
+        case ExportSocketOption:
+            settings.exportSocket = optarg;
+            break;
+        case ExportSizeOption:
+            if (sscanf(optarg, "%dx%d", &settings.exportWidth, &settings.exportHeight) != 2) {
+                std::cerr << "Expected WxH for --export-size: " << optarg << "\n\n";
+                return false;
+            }
+            break;
+        case SoakOption: {
+            char *end = nullptr;
+            errno = 0;
+            settings.soakLoops = strtoull(optarg, &end, 10);
+            if (!g_ascii_isdigit(optarg[0]) || *end != '\0' || errno != 0 || settings.soakLoops == 0) {
+                std::cerr << "Soak needs at least one loop: " << optarg << "\n\n";
+                return false;
+            }
+            settings.loop = true;
+            settings.sync = false;
+            break;
+        }
+        case SoakThresholdOption: {
+            char *end = nullptr;
+            errno = 0;
+            settings.soakThreshold = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || errno != 0 || !(settings.soakThreshold >= 0)) {
+                std::cerr << "Soak threshold must be a non-negative percentage: " << optarg << "\n\n";
+                return false;
+            }
+            break;
+        }
 
         case 'l':
             settings.loop = true;
@@ -91,6 +216,32 @@ bool CLIHandler::splitArgs(const int argc, char *argv[], VideoSettings& settings
         case 'd':
             GStreamer::enableDebug(atoi(optarg));
             break;
+        case SlideshowOption:
+            if ((ret = atoi(optarg)) <= 0) {
+                std::cerr << "Slideshow interval must be a positive number of ms: " << optarg << "\n\n";
+                return false;
+            }
+            settings.slideshowInterval = ret;
+            break;
+        case FakeMonitorsOption:
+            settings.fakeMonitors = optarg;
+            break;
+        case DisplayOption:
+            settings.displays = optarg;
+            break;
+        case WidgetOption:
+            settings.widgets.push_back(optarg);
+            break;
+        case WidgetFontSizeOption:
+            if ((ret = atoi(optarg)) <= 0) {
+                std::cerr << "Widget font size must be a positive number of points: " << optarg << "\n\n";
+                return false;
+            }
+            settings.widgetFontSize = ret;
+            break;
+        case RebuildRegistryOption:
+            // GStreamer::initialize already rescanned the plugins before the arguments were parsed
+            return true;
         case 'v':
             std::cout << PROJECT_NAME << " " << PROJECT_VERSION << "\n";
             return true;
@@ -123,11 +274,37 @@ void CLIHandler::printHelp(const char* prog_name) {
               << "  " << prog_name << " [options] <video file>\n\n"
               << "Options:\n"
               << "  -o, --overlay <sink>               Set video overlay sink\n"
-              << "                                     Supported sinks: X11, OpenGL, Wayland, DirectX\n"
-              << "  -f, --force-decoder <decoder>      Force video decoder\n"
-              << "                                     Supported decoders: Default, Software, NVIDIA, VAAPI, DirectX3D\n"
+              << "                                     Supported sinks: X11, OpenGL, Wayland, DirectX, XShm, Offscreen\n"
+              << "                                     Offscreen renders without an X server\n"
+              << "      --tile-size <px>               Damage tile size for -o XShm (default 64)\n"
+              << "      --fake-monitors <WxH+X+Y[@Hz],...>\n"
+              << "                                     Use this monitor layout instead of RandR\n"
+              << "      --display <:0,:1,...>          Cover the monitors of several X displays with one decoder\n"
+              << "      --widget <kind[:arg][@X,Y]>    Draw a widget on every monitor, with -o XShm or Offscreen\n"
+              << "                                     Kinds: clock[:strftime], text:<text>, hostname, image:<path>,\n"
+              << "                                     file:<path> (shows its text); X,Y with a minus sign count\n"
+              << "                                     from the right/bottom edge, -0 is flush. May be repeated\n"
+              << "      --widget-font-size <pt>        Font size of text widgets (default 24)\n"
+              << "  -f, --force-decoder, --decoder <decoder>\n"
+              << "                                     Force video decoder\n"
+              << "                                     Supported decoders: Default, Software, NVIDIA, VAAPI, DirectX3D, auto-bench\n"
+              << "                                     auto-bench times every usable decoder once and caches the fastest\n"
+              << "  -s, --source <source>              Set how the video file is read\n"
+              << "                                     Supported sources: File, MMap, Memory\n"
+              << "      --mmap-populate                Prefault the whole mapping on load\n"
+              << "      --mmap-lock                    Lock the loaded file in RAM\n"
+              << "      --memory-limit <MiB>           Largest file to load with -s Memory, or decoded image (default 512)\n"
               << "  -l, --loop                         Enable video looping\n"
+              << "      --video-track <n>              Decode the n-th video track, others are dropped (default 0)\n"
+              << "      --slideshow <ms>               Decode keyframes only and show a new one every <ms>\n"
               << "  -d, --gst-debug-level <level>      Set GStreamer debug level (0-7)\n"
+              << "      --export-socket <path>         Share decoded frames with local clients over this socket\n"
+              << "      --export-size <WxH>            Scale exported frames (default: video size)\n"
+              << "      --trace <file>                 Write a per-buffer Chrome trace on exit\n"
+              << "      --soak <loops>                 Play the clip unsynced for this many loops and fail on\n"
+              << "                                     growing memory, fds, threads, live objects or loop time\n"
+              << "      --soak-threshold <%>           Allowed growth over the soak run (default 10)\n"
+              << "      --rebuild-registry             Rescan the whitelisted plugins into the private registry and exit\n"
               << "  -h, --help                         Print this help message\n\n"
               << "Example:\n"
               << "  " << prog_name << " -o glimagesink -f NVIDIA -q high -l video.mp4\n\n";
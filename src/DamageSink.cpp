@@ -0,0 +1,286 @@
+/*
+ * File name: DamageSink.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "DamageSink.h"
+#include <gst/video/video.h>
+#include <glib-unix.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <atomic>
+#include <cstring>
+#include "Simd.h"
+#include "KLoggeg.h"
+
+static const guint64 REPORT_INTERVAL = 300;
+
+// Xlib has one error handler per process, other connections keep going to the previous one
+static std::atomic<Display*> attachingDisplay = nullptr;
+static std::atomic<bool> attachFailed = false;
+static XErrorHandler previousHandler = nullptr;
+
+static int onAttachError(Display *display, XErrorEvent *event) {
+    if (display == attachingDisplay) {
+        attachFailed = true;
+        return 0;
+    }
+    return previousHandler ? previousHandler(display, event) : 0;
+}
+
+DamageSink::DamageSink(const MonitorInfo& monitor, Window window, unsigned int tileSize)
+    : monitor(monitor), window(window), tileSize(tileSize), display(nullptr), gc(nullptr), image(nullptr),
+      shminfo(), useShm(false), fullUpdate(true), eventSource(0), frames(0), skipped(0), tiles(0), updatedTiles(0) {}
+
+DamageSink::~DamageSink() {
+    if (eventSource) {
+        g_source_remove(eventSource);
+    }
+    if (image) {
+        if (useShm && image->data) {
+            XShmDetach(display, &shminfo);
+            XSync(display, False);
+            shmdt(shminfo.shmaddr);
+        }
+        XDestroyImage(image);
+    }
+    if (gc) {
+        XFreeGC(display, gc);
+    }
+    if (display) {
+        XCloseDisplay(display);
+    }
+}
+
+bool DamageSink::init() {
+    // Frames arrive on a streaming thread, so the sink talks to X over its own connection
+    display = XOpenDisplay(DisplayString(monitor.display ? monitor.display : XrandrManager::getDisplay()));
+    if (!display) {
+        error("DamageSink") << "Failed to open display";
+        return false;
+    }
+
+    int screen = DefaultScreen(display);
+    Visual* visual = DefaultVisual(display, screen);
+    int depth = DefaultDepth(display, screen);
+
+    useShm = XShmQueryExtension(display) && attachShm(visual, depth);
+    if (!useShm) {
+        warning("DamageSink") << "MIT-SHM is not available, falling back to XPutImage";
+        image = XCreateImage(display, visual, depth, ZPixmap, 0, nullptr, monitor.width, monitor.height, 32, 0);
+        if (image) {
+            image->data = static_cast<char*>(calloc(image->bytes_per_line, image->height));
+        }
+    }
+
+    if (!image || !image->data || image->bits_per_pixel != 32) {
+        error("DamageSink") << "Unsupported visual for " << monitor.name << ", 32 bpp TrueColor is required";
+        return false;
+    }
+
+    gc = XCreateGC(display, window, 0, nullptr);
+
+    // Unchanged tiles are never uploaded again, so exposed parts of the window are repainted from the
+    // image, also while the video is paused or the branch is detached
+    XSelectInput(display, window, ExposureMask);
+    eventSource = g_unix_fd_add(ConnectionNumber(display), G_IO_IN, onEvents, this);
+
+    unsigned int columns = (monitor.width + tileSize - 1) / tileSize;
+    dirty.resize(columns);
+    return true;
+}
+
+bool DamageSink::attachShm(Visual* visual, int depth) {
+    image = XShmCreateImage(display, visual, depth, ZPixmap, nullptr, &shminfo, monitor.width, monitor.height);
+    if (!image) {
+        return false;
+    }
+    shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    void* addr = shminfo.shmid >= 0 ? shmat(shminfo.shmid, nullptr, 0) : reinterpret_cast<void*>(-1);
+    bool attached = false;
+    if (addr != reinterpret_cast<void*>(-1)) {
+        shminfo.shmaddr = image->data = static_cast<char*>(addr);
+        shminfo.readOnly = False;
+
+        // The extension is there on remote and sandboxed servers too, they only fail the attach itself,
+        // asynchronously with BadAccess
+        attachingDisplay = display;
+        attachFailed = false;
+        previousHandler = XSetErrorHandler(onAttachError);
+        attached = XShmAttach(display, &shminfo);
+        XSync(display, False);
+        XSetErrorHandler(previousHandler);
+        attachingDisplay = nullptr;
+        attached = attached && !attachFailed;
+    }
+    if (shminfo.shmid >= 0) {
+        shmctl(shminfo.shmid, IPC_RMID, nullptr);
+    }
+    if (attached) {
+        return true;
+    }
+
+    if (addr != reinterpret_cast<void*>(-1)) {
+        shmdt(addr);
+    }
+    image->data = nullptr;
+    XDestroyImage(image);
+    image = nullptr;
+    shminfo = {};
+    return false;
+}
+
+void DamageSink::attach(GstAppSink* appsink) {
+    {
+        // The window may have been exposed while no branch drew into it
+        std::lock_guard<std::mutex> lock(renderMutex);
+        fullUpdate = true;
+    }
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.new_sample = onNewSample;
+    gst_app_sink_set_callbacks(appsink, &callbacks, this, nullptr);
+    gst_app_sink_set_max_buffers(appsink, 1);
+    gst_app_sink_set_drop(appsink, TRUE);
+}
+
+GstFlowReturn DamageSink::onNewSample(GstAppSink* appsink, gpointer data) {
+    DamageSink *sink = static_cast<DamageSink*>(data);
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (!sample) {
+        return GST_FLOW_EOS;
+    }
+
+    GstVideoInfo info;
+    GstVideoFrame frame;
+    if (gst_video_info_from_caps(&info, gst_sample_get_caps(sample)) &&
+        GST_VIDEO_INFO_WIDTH(&info) == sink->monitor.width &&
+        GST_VIDEO_INFO_HEIGHT(&info) == sink->monitor.height &&
+        gst_video_frame_map(&frame, &info, gst_sample_get_buffer(sample), GST_MAP_READ)) {
+        std::lock_guard<std::mutex> lock(sink->renderMutex);
+        sink->render(static_cast<const guint8*>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0)),
+                     GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0));
+        gst_video_frame_unmap(&frame);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+gboolean DamageSink::onEvents(gint, GIOCondition, gpointer data) {
+    DamageSink *sink = static_cast<DamageSink*>(data);
+    std::lock_guard<std::mutex> lock(sink->renderMutex);
+    sink->repaintExposed();
+    return G_SOURCE_CONTINUE;
+}
+
+// Called with renderMutex held. Every XSync reads events the fd watch is not woken for again,
+// so the queue is drained until a pass repaints nothing.
+void DamageSink::repaintExposed() {
+    for (bool exposed = true; exposed;) {
+        exposed = false;
+        while (XPending(display)) {
+            XEvent event;
+            XNextEvent(display, &event);
+            if (event.type != Expose) {
+                continue;
+            }
+            int x = MIN(event.xexpose.x, monitor.width);
+            int y = MIN(event.xexpose.y, monitor.height);
+            int width = MIN(event.xexpose.width, monitor.width - x);
+            int height = MIN(event.xexpose.height, monitor.height - y);
+            if (width > 0 && height > 0) {
+                putImage(x, y, width, height);
+                exposed = true;
+            }
+        }
+        if (exposed) {
+            XSync(display, False);
+        }
+    }
+}
+
+void DamageSink::render(const guint8* data, int stride) {
+    guint8 *pixels = reinterpret_cast<guint8*>(image->data);
+    int pitch = image->bytes_per_line;
+    int columns = dirty.size();
+    bool presented = false;
+
+    for (int ty = 0; ty < monitor.height; ty += tileSize) {
+        int rows = MIN(static_cast<int>(tileSize), monitor.height - ty);
+
+        // The image still holds the last presented frame, so it doubles as the reference
+        for (int column = 0; column < columns; column++) {
+            int tx = column * tileSize;
+            int bytes = MIN(static_cast<int>(tileSize), monitor.width - tx) * 4;
+            bool changed = fullUpdate;
+            for (int y = ty; y < ty + rows && !changed; y++) {
+                changed = !Simd::equal(data + y * stride + tx * 4, pixels + y * pitch + tx * 4, bytes);
+            }
+            if (changed) {
+                for (int y = ty; y < ty + rows; y++) {
+                    std::memcpy(pixels + y * pitch + tx * 4, data + y * stride + tx * 4, bytes);
+                }
+                updatedTiles++;
+            }
+            dirty[column] = changed;
+        }
+        tiles += columns;
+
+        // Neighbouring dirty tiles in a row go out as one request
+        for (int column = 0; column < columns;) {
+            if (!dirty[column]) {
+                column++;
+                continue;
+            }
+            int first = column;
+            while (column < columns && dirty[column]) {
+                column++;
+            }
+            int x = first * tileSize;
+            putImage(x, ty, MIN(column * static_cast<int>(tileSize), monitor.width) - x, rows);
+            presented = true;
+        }
+    }
+
+    if (presented) {
+        // The server reads the shared segment asynchronously, wait before it is touched again
+        XSync(display, False);
+    } else {
+        skipped++;
+    }
+
+    fullUpdate = false;
+    repaintExposed();
+    if (++frames % REPORT_INTERVAL == 0) {
+        report();
+    }
+}
+
+void DamageSink::putImage(int x, int y, int width, int height) {
+    if (useShm) {
+        XShmPutImage(display, window, gc, image, x, y, x, y, width, height, False);
+    } else {
+        XPutImage(display, window, gc, image, x, y, x, y, width, height);
+    }
+}
+
+void DamageSink::report() {
+    info("DamageSink") << monitor.name << ": " << (tiles ? 100.0 * updatedTiles / tiles : 0.0)
+                       << "% tiles updated, " << skipped << " of " << frames << " frames skipped";
+    tiles = updatedTiles = 0;
+    skipped = frames = 0;
+}
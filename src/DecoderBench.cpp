@@ -0,0 +1,281 @@
+/*
+ * File name: DecoderBench.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "DecoderBench.h"
+#include <glib/gstdio.h>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sys/resource.h>
+#include "GStreamer.h"
+#include "KLoggeg.h"
+
+static const guint WARMUP_FRAMES = 10;
+static const guint SAMPLE_FRAMES = 60;
+static const GstClockTime BENCH_TIMEOUT = 10 * GST_SECOND;
+
+struct ProbeContext {
+    std::mutex mutex;
+    GstCaps *caps = nullptr;
+    GstElement *decoder = nullptr;
+};
+
+struct SampleContext {
+    std::atomic<guint> frames = 0;
+    gint64 cpuStart = 0;
+    gint64 cpuEnd = 0;
+    GstBus *bus = nullptr;
+};
+
+static gint64 cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+           + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static bool isVideoPad(GstPad *pad, GstCaps **out) {
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps) {
+        caps = gst_pad_query_caps(pad, nullptr);
+    }
+    bool video = caps && !gst_caps_is_empty(caps) &&
+                 g_str_has_prefix(gst_structure_get_name(gst_caps_get_structure(caps, 0)), "video/");
+    if (video && out) {
+        *out = caps;
+    } else if (caps) {
+        gst_caps_unref(caps);
+    }
+    return video;
+}
+
+static void onParsedPad(GstElement *element, GstPad *pad, gpointer data) {
+    ProbeContext *context = static_cast<ProbeContext*>(data);
+    std::lock_guard<std::mutex> lock(context->mutex);
+
+    if (context->decoder) {
+        GstPad *sink_pad = gst_element_get_static_pad(context->decoder, "sink");
+        if (!gst_pad_is_linked(sink_pad) && isVideoPad(pad, nullptr)) {
+            gst_pad_link(pad, sink_pad);
+        }
+        gst_object_unref(sink_pad);
+    } else if (!context->caps) {
+        isVideoPad(pad, &context->caps);
+    }
+}
+
+static GstPadProbeReturn onDecodedFrame(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    SampleContext *context = static_cast<SampleContext*>(data);
+    guint frame = ++context->frames;
+
+    if (frame == WARMUP_FRAMES) {
+        context->cpuStart = cpuTime();
+    } else if (frame == WARMUP_FRAMES + SAMPLE_FRAMES) {
+        context->cpuEnd = cpuTime();
+        gst_bus_post(context->bus, gst_message_new_application(nullptr, gst_structure_new_empty("sampled")));
+        return GST_PAD_PROBE_REMOVE;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstElement* createParser(const std::string& filename, GstElement **parser) {
+    GstElement *pipeline = gst_pipeline_new(nullptr);
+    GstElement *source = gst_element_factory_make("filesrc", nullptr);
+    *parser = gst_element_factory_make("parsebin", nullptr);
+    if (!pipeline || !source || !*parser) {
+        error("DecoderBench") << "Failed to create the sample pipeline";
+        return nullptr;
+    }
+
+    g_object_set(G_OBJECT(source), "location", filename.data(), NULL);
+    gst_bin_add_many(GST_BIN(pipeline), source, *parser, NULL);
+    gst_element_link(source, *parser);
+    return pipeline;
+}
+
+bool DecoderBench::select(const std::string& filename) {
+    GstCaps *caps = probeCaps(filename);
+    if (!caps) {
+        error("DecoderBench") << "No video stream found in " << filename;
+        return false;
+    }
+
+    std::string key = cacheKey(caps);
+    auto cache = loadCache();
+    auto cached = cache.find(key);
+    if (cached != cache.end()) {
+        GstPluginFeature *feature = gst_registry_lookup_feature(gst_registry_get(), cached->second.data());
+        if (feature) {
+            gst_object_unref(feature);
+            gst_caps_unref(caps);
+            info("DecoderBench") << "Using cached decoder " << cached->second << " for " << key;
+            return GStreamer::changeRank(cached->second.data(), GST_RANK_PRIMARY + 1);
+        }
+    }
+
+    GList *decoders = gst_element_factory_list_get_elements(
+        GST_ELEMENT_FACTORY_TYPE_DECODER | GST_ELEMENT_FACTORY_TYPE_MEDIA_VIDEO, GST_RANK_MARGINAL);
+    GList *candidates = gst_element_factory_list_filter(decoders, caps, GST_PAD_SINK, FALSE);
+    gst_plugin_feature_list_free(decoders);
+    gst_caps_unref(caps);
+
+    std::string best;
+    double bestCost = G_MAXDOUBLE;
+    for (GList *item = candidates; item; item = item->next) {
+        const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(item->data));
+        double cost = measure(filename, name);
+        if (cost < 0) {
+            info("DecoderBench") << name << ": failed";
+            continue;
+        }
+        info("DecoderBench") << name << ": " << cost << " us CPU/frame";
+        if (cost < bestCost) {
+            bestCost = cost;
+            best = name;
+        }
+    }
+    gst_plugin_feature_list_free(candidates);
+
+    if (best.empty()) {
+        warning("DecoderBench") << "No decoder could be benchmarked for " << key << ", keeping registry ranks";
+        return false;
+    }
+
+    info("DecoderBench") << "Selected " << best << " for " << key;
+    cache[key] = best;
+    saveCache(cache);
+    return GStreamer::changeRank(best.data(), GST_RANK_PRIMARY + 1);
+}
+
+GstCaps* DecoderBench::probeCaps(const std::string& filename) {
+    GstElement *parser;
+    GstElement *pipeline = createParser(filename, &parser);
+    if (!pipeline) {
+        return nullptr;
+    }
+
+    ProbeContext context;
+    g_signal_connect(parser, "pad-added", G_CALLBACK(onParsedPad), &context);
+
+    // The parsed pads are exposed while prerolling, which is all that is needed here
+    gst_element_set_state(pipeline, GST_STATE_PAUSED);
+    gst_element_get_state(pipeline, nullptr, nullptr, BENCH_TIMEOUT);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    return context.caps;
+}
+
+double DecoderBench::measure(const std::string& filename, const gchar* factoryName) {
+    GstElement *parser;
+    GstElement *pipeline = createParser(filename, &parser);
+    GstElement *decoder = gst_element_factory_make(factoryName, nullptr);
+    GstElement *sink = gst_element_factory_make("fakesink", nullptr);
+    if (!pipeline || !decoder || !sink) {
+        if (pipeline) {
+            gst_object_unref(pipeline);
+        }
+        return -1;
+    }
+
+    g_object_set(G_OBJECT(sink), "sync", FALSE, NULL);
+    gst_bin_add_many(GST_BIN(pipeline), decoder, sink, NULL);
+    gst_element_link(decoder, sink);
+
+    ProbeContext probe;
+    probe.decoder = decoder;
+    g_signal_connect(parser, "pad-added", G_CALLBACK(onParsedPad), &probe);
+
+    SampleContext sample;
+    sample.bus = gst_element_get_bus(pipeline);
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, onDecodedFrame, &sample, nullptr);
+    gst_object_unref(sink_pad);
+
+    double cost = -1;
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+        // Clips shorter than the warm-up and sample frames are looped, the frame count carries over
+        gint64 deadline = g_get_monotonic_time() + BENCH_TIMEOUT / GST_USECOND;
+        for (;;) {
+            gint64 remaining = MAX(deadline - g_get_monotonic_time(), 0);
+            GstMessage *msg = gst_bus_timed_pop_filtered(sample.bus, remaining * GST_USECOND,
+                static_cast<GstMessageType>(GST_MESSAGE_APPLICATION | GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+            if (!msg) {
+                break;
+            }
+            GstMessageType type = GST_MESSAGE_TYPE(msg);
+            gst_message_unref(msg);
+            if (type == GST_MESSAGE_APPLICATION) {
+                cost = static_cast<double>(sample.cpuEnd - sample.cpuStart) / SAMPLE_FRAMES;
+                break;
+            }
+            if (type != GST_MESSAGE_EOS || !gst_element_seek_simple(pipeline, GST_FORMAT_TIME,
+                    static_cast<GstSeekFlags>(GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT), 0)) {
+                break;
+            }
+        }
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(sample.bus);
+    gst_object_unref(pipeline);
+    return cost;
+}
+
+std::string DecoderBench::cacheKey(GstCaps* caps) {
+    const GstStructure *structure = gst_caps_get_structure(caps, 0);
+    int height = 0;
+    gst_structure_get_int(structure, "height", &height);
+
+    const char *resolution = height <= 576 ? "sd" : height <= 1080 ? "hd" : height <= 2160 ? "uhd" : "8k";
+    return std::string(gst_structure_get_name(structure)) + "@" + resolution;
+}
+
+std::string DecoderBench::cachePath() {
+    gchar *path = g_build_filename(g_get_user_cache_dir(), "kabegami", "decoders", nullptr);
+    std::string result = path;
+    g_free(path);
+    return result;
+}
+
+std::map<std::string, std::string> DecoderBench::loadCache() {
+    std::map<std::string, std::string> cache;
+    std::ifstream in(cachePath());
+    std::string key, decoder;
+    while (in >> key >> decoder) {
+        cache[key] = decoder;
+    }
+    return cache;
+}
+
+void DecoderBench::saveCache(const std::map<std::string, std::string>& cache) {
+    std::string path = cachePath();
+    gchar *dir = g_path_get_dirname(path.data());
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    std::ofstream out(path);
+    if (!out) {
+        warning("DecoderBench") << "Failed to write " << path;
+        return;
+    }
+    for (const auto& [key, decoder] : cache) {
+        out << key << " " << decoder << "\n";
+    }
+}
@@ -0,0 +1,279 @@
+/*
+ * File name: FrameExporter.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "FrameExporter.h"
+#include <glib-unix.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "KLoggeg.h"
+
+static const uint32_t EXPORT_SLOTS = 3;
+static const size_t PAGE = 4096;
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010 // Linux 5.1
+#endif
+
+static size_t pageAlign(size_t size) {
+    return (size + PAGE - 1) & ~(PAGE - 1);
+}
+
+// The path comes from the command line, only a socket left behind by an earlier run may be removed
+static bool removeSocket(const std::string& path) {
+    struct stat st;
+    if (lstat(path.data(), &st) != 0) {
+        return errno == ENOENT;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        error("FrameExporter") << path << " exists and is not a socket, refusing to replace it";
+        return false;
+    }
+    return unlink(path.data()) == 0;
+}
+
+FrameExporter::FrameExporter(const std::string& socketPath)
+    : socketPath(socketPath), listenFd(-1), acceptSource(0), memfd(-1), readOnlyFd(-1), mapping(nullptr),
+      mappingSize(0), header(nullptr), frames(0) {}
+
+FrameExporter::~FrameExporter() {
+    if (acceptSource) {
+        g_source_remove(acceptSource);
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        removeSocket(socketPath);
+    }
+    for (int client : clients) {
+        close(client);
+    }
+    if (mapping) {
+        munmap(mapping, mappingSize);
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    if (readOnlyFd >= 0) {
+        close(readOnlyFd);
+    }
+}
+
+bool FrameExporter::init() {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        error("FrameExporter") << "Socket path is too long: " << socketPath;
+        return false;
+    }
+    std::strncpy(addr.sun_path, socketPath.data(), sizeof(addr.sun_path) - 1);
+
+    if (!removeSocket(socketPath)) {
+        return false;
+    }
+
+    // Packets keep each 8-byte announcement whole, a full client buffer drops it instead of splitting it
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listenFd < 0 ||
+        bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listenFd, 8) != 0) {
+        error("FrameExporter") << "Failed to listen on " << socketPath << ": " << std::strerror(errno);
+        if (listenFd >= 0) {
+            close(listenFd); // the path is not ours, the destructor must leave it alone
+            listenFd = -1;
+        }
+        return false;
+    }
+
+    acceptSource = g_unix_fd_add(listenFd, G_IO_IN, onAccept, this);
+    info("FrameExporter") << "Exporting frames on " << socketPath;
+    return true;
+}
+
+void FrameExporter::attach(GstAppSink* appsink) {
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.new_sample = onNewSample;
+    gst_app_sink_set_callbacks(appsink, &callbacks, this, nullptr);
+    gst_app_sink_set_max_buffers(appsink, 1);
+    gst_app_sink_set_drop(appsink, TRUE);
+}
+
+gboolean FrameExporter::onAccept(gint fd, GIOCondition condition, gpointer data) {
+    FrameExporter *exporter = static_cast<FrameExporter*>(data);
+    int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client < 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    std::lock_guard<std::mutex> lock(exporter->mutex);
+    exporter->clients.push_back(client);
+    if (exporter->header) {
+        exporter->sendDescriptor(client);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+GstFlowReturn FrameExporter::onNewSample(GstAppSink* appsink, gpointer data) {
+    FrameExporter *exporter = static_cast<FrameExporter*>(data);
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (!sample) {
+        return GST_FLOW_EOS;
+    }
+
+    GstVideoInfo info;
+    GstVideoFrame frame;
+    if (gst_video_info_from_caps(&info, gst_sample_get_caps(sample)) &&
+        (exporter->header || exporter->createBuffer(info)) &&
+        gst_video_frame_map(&frame, &info, gst_sample_get_buffer(sample), GST_MAP_READ)) {
+        exporter->publish(frame);
+        gst_video_frame_unmap(&frame);
+    }
+
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+bool FrameExporter::createBuffer(const GstVideoInfo& videoInfo) {
+    // Sized from the first frame, the export resolution is fixed for the whole run
+    uint32_t stride = GST_VIDEO_INFO_WIDTH(&videoInfo) * 4;
+    size_t slotSize = pageAlign(static_cast<size_t>(stride) * GST_VIDEO_INFO_HEIGHT(&videoInfo));
+    size_t dataOffset = pageAlign(sizeof(ExportHeader));
+    size_t size = dataOffset + slotSize * EXPORT_SLOTS;
+
+    int fd = memfd_create("kabegami-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        error("FrameExporter") << "Failed to create shared frame buffer: " << std::strerror(errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        error("FrameExporter") << "Failed to map shared frame buffer: " << std::strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    // Our mapping stays writable, clients get a read-only descriptor and the seal stops them from
+    // reopening it for writing through /proc
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) != 0) {
+        warning("FrameExporter") << "Kernel can not seal against writes, relying on the read-only descriptor";
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL);
+
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    int readOnly = open(path.data(), O_RDONLY | O_CLOEXEC);
+    if (readOnly < 0) {
+        error("FrameExporter") << "Failed to reopen the frame buffer read-only: " << std::strerror(errno);
+        munmap(data, size);
+        close(fd);
+        return false;
+    }
+
+    ExportHeader *created = new (data) ExportHeader();
+    created->magic = EXPORT_MAGIC;
+    created->version = EXPORT_VERSION;
+    created->width = GST_VIDEO_INFO_WIDTH(&videoInfo);
+    created->height = GST_VIDEO_INFO_HEIGHT(&videoInfo);
+    created->stride = stride;
+    created->format = GST_MAKE_FOURCC('B', 'G', 'R', 'x');
+    created->slots = EXPORT_SLOTS;
+    created->slotSize = slotSize;
+    created->dataOffset = dataOffset;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    memfd = fd;
+    readOnlyFd = readOnly;
+    mapping = static_cast<guint8*>(data);
+    mappingSize = size;
+    header = created;
+    for (int client : clients) {
+        sendDescriptor(client);
+    }
+
+    info("FrameExporter") << "Shared " << created->width << "x" << created->height << " BGRx frames, "
+                          << EXPORT_SLOTS << " slots, " << size << " bytes";
+    return true;
+}
+
+void FrameExporter::publish(const GstVideoFrame& frame) {
+    if (GST_VIDEO_FRAME_WIDTH(&frame) != static_cast<int>(header->width) ||
+        GST_VIDEO_FRAME_HEIGHT(&frame) != static_cast<int>(header->height)) {
+        return;
+    }
+
+    uint64_t number = frames++;
+    ExportSlot& slot = header->slot[number % header->slots];
+    guint8 *dst = mapping + header->dataOffset + (number % header->slots) * header->slotSize;
+    const guint8 *src = static_cast<const guint8*>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0));
+    int srcStride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0);
+
+    slot.sequence.store(2 * number + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (uint32_t y = 0; y < header->height; y++) {
+        std::memcpy(dst + y * header->stride, src + y * srcStride, header->stride);
+    }
+    slot.pts = GST_BUFFER_PTS(frame.buffer);
+
+    slot.sequence.store(2 * number + 2, std::memory_order_release);
+    header->latest.store(number + 1, std::memory_order_release);
+
+    // Announcements are best effort, a client with a full socket buffer just misses this one
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = clients.begin(); it != clients.end();) {
+        ssize_t sent = send(*it, &number, sizeof(number), MSG_DONTWAIT | MSG_NOSIGNAL);
+        bool dropped = sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (!dropped && sent != static_cast<ssize_t>(sizeof(number))) {
+            close(*it);
+            it = clients.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void FrameExporter::sendDescriptor(int client) {
+    char byte = 'K';
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &readOnlyFd, sizeof(int));
+
+    if (sendmsg(client, &msg, MSG_NOSIGNAL) < 0) {
+        warning("FrameExporter") << "Failed to pass the frame buffer to a client: " << std::strerror(errno);
+    }
+}
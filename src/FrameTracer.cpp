@@ -0,0 +1,238 @@
+/*
+ * File name: FrameTracer.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "FrameTracer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include "KLoggeg.h"
+
+// Ring size per streaming thread, the newest events win once it wraps
+static const size_t EVENTS_PER_THREAD = 1 << 16;
+
+struct TracePoint {
+    std::string element;
+    std::string pad;
+    bool input;
+};
+
+struct TraceEvent {
+    gint64 ts;
+    GstClockTime pts;
+    guint point;
+};
+
+struct ThreadBuffer {
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(EVENTS_PER_THREAD);
+    std::atomic<size_t> count = 0;
+    std::atomic<gint64> overhead = 0;
+    pid_t tid = gettid();
+    std::string name;
+};
+
+std::string FrameTracer::path;
+
+static std::mutex registryMutex;
+static std::vector<TracePoint> points;
+static std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+static thread_local ThreadBuffer* current = nullptr;
+
+static gint64 now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static ThreadBuffer* threadBuffer() {
+    if (!current) {
+        auto buffer = std::make_unique<ThreadBuffer>();
+        char name[16] = {};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        buffer->name = name;
+
+        std::lock_guard<std::mutex> lock(registryMutex);
+        current = buffer.get();
+        buffers.push_back(std::move(buffer));
+    }
+    return current;
+}
+
+static std::string escape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+void FrameTracer::enable(const std::string& tracePath) {
+    path = tracePath;
+}
+
+bool FrameTracer::isEnabled() {
+    return !path.empty();
+}
+
+void FrameTracer::attach(GstElement* element) {
+    if (!isEnabled()) {
+        return;
+    }
+
+    GstIterator *it = gst_element_iterate_pads(element);
+    GValue item = G_VALUE_INIT;
+    while (gst_iterator_next(it, &item) == GST_ITERATOR_OK) {
+        attachPad(element, GST_PAD(g_value_get_object(&item)));
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+
+    g_signal_connect(element, "pad-added", G_CALLBACK(onPadAdded), nullptr);
+}
+
+void FrameTracer::attachPad(GstElement* element, GstPad* pad) {
+    guint point;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        point = points.size();
+        gchar *element_name = gst_element_get_name(element);
+        gchar *pad_name = gst_pad_get_name(pad);
+        points.push_back({element_name, pad_name, GST_PAD_IS_SINK(pad)});
+        g_free(element_name);
+        g_free(pad_name);
+    }
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, onBuffer, GUINT_TO_POINTER(point), nullptr);
+}
+
+void FrameTracer::onPadAdded(GstElement* element, GstPad* pad, gpointer data) {
+    attachPad(element, pad);
+}
+
+GstPadProbeReturn FrameTracer::onBuffer(GstPad* pad, GstPadProbeInfo* info, gpointer data) {
+    gint64 start = now();
+    ThreadBuffer *buffer = threadBuffer();
+
+    size_t index = buffer->count.load(std::memory_order_relaxed);
+    TraceEvent& event = buffer->events[index % EVENTS_PER_THREAD];
+    event.ts = start;
+    event.pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+    event.point = GPOINTER_TO_UINT(data);
+    buffer->count.store(index + 1, std::memory_order_release);
+
+    buffer->overhead.fetch_add(now() - start, std::memory_order_relaxed);
+    return GST_PAD_PROBE_OK;
+}
+
+bool FrameTracer::write() {
+    if (!isEnabled()) {
+        return true;
+    }
+
+    std::ofstream out(path);
+    if (!out) {
+        error("FrameTracer") << "Failed to open " << path;
+        return false;
+    }
+
+    out << std::fixed << std::setprecision(3);
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    pid_t pid = getpid();
+    guint64 recorded = 0;
+    guint64 overwritten = 0;
+    gint64 overhead = 0;
+    bool first = true;
+
+    auto separator = [&out, &first]() {
+        out << (first ? "\n" : ",\n");
+        first = false;
+    };
+
+    struct Record {
+        TraceEvent event;
+        pid_t tid;
+    };
+    std::vector<Record> records;
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (const auto& buffer : buffers) {
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        size_t begin = count > EVENTS_PER_THREAD ? count - EVENTS_PER_THREAD : 0;
+        recorded += count - begin;
+        overwritten += begin;
+        overhead += buffer->overhead.load();
+
+        separator();
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"" << escape(buffer->name) << "\"}}";
+
+        for (size_t i = begin; i < count; i++) {
+            records.push_back({buffer->events[i % EVENTS_PER_THREAD], buffer->tid});
+        }
+    }
+
+    // Buffers enter and leave an element on different threads, so spans are matched in time order
+    std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) {
+        return a.event.ts < b.event.ts;
+    });
+    std::map<std::pair<guint, GstClockTime>, gint64> entries;
+    std::map<std::string, guint> elements;
+
+    for (const auto& record : records) {
+        const TraceEvent& event = record.event;
+        const TracePoint& point = points[event.point];
+
+        separator();
+        out << "{\"name\":\"" << escape(point.element + ":" + point.pad) << "\",\"cat\":\"pad\",\"ph\":\"i\",\"s\":\"t\""
+            << ",\"pid\":" << pid << ",\"tid\":" << record.tid << ",\"ts\":" << event.ts / 1000.0
+            << ",\"args\":{\"pts\":" << static_cast<gint64>(event.pts) << "}}";
+
+        if (!GST_CLOCK_TIME_IS_VALID(event.pts)) {
+            continue;
+        }
+        guint element = elements.emplace(point.element, elements.size()).first->second;
+        auto key = std::make_pair(element, event.pts);
+        if (point.input) {
+            entries[key] = event.ts;
+        } else if (auto it = entries.find(key); it != entries.end()) {
+            separator();
+            out << "{\"name\":\"" << escape(point.element) << "\",\"cat\":\"element\",\"ph\":\"X\""
+                << ",\"pid\":" << pid << ",\"tid\":" << record.tid << ",\"ts\":" << it->second / 1000.0
+                << ",\"dur\":" << (event.ts - it->second) / 1000.0
+                << ",\"args\":{\"pts\":" << static_cast<gint64>(event.pts) << "}}";
+            entries.erase(it);
+        }
+    }
+    out << "\n]}\n";
+
+    info("FrameTracer") << "Wrote " << recorded << " events to " << path << " (" << overwritten << " overwritten), "
+                        << "recording cost " << overhead / 1000 << " us total, "
+                        << (recorded + overwritten ? overhead / static_cast<gint64>(recorded + overwritten) : 0) << " ns/event";
+    return true;
+}
@@ -23,10 +23,23 @@
 
 #include <cstdint>
 #include <gst/gst.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
 #include "GStreamer.h"
 #include "KLoggeg.h"
 
 GMainLoop* GStreamer::loop = nullptr;
+std::string GStreamer::registryDir;
+std::string GStreamer::registryFingerprint;
+bool GStreamer::registryWarm = true;
+
+// Every plugin the player, widgets, benchmarks and decoder selection can use, nothing else is scanned
+static const char* PLUGIN_WHITELIST[] = {
+    "coreelements", "coretracers", "app", "playback", "typefindfunctions", "isomp4",
+    "videoconvertscale", "videoconvert", "videoscale", "videorate", "videotestsrc", "videoparsersbad",
+    "ximagesink", "xvimagesink", "opengl", "waylandsink", "pango", "png", "jpeg",
+    "libav", "openh264", "x264", "vpx", "dav1d", "aom", "nvcodec", "va", "vaapi",
+};
 
 void gst_log(GstDebugCategory * category,
                     GstDebugLevel      level,
@@ -68,16 +81,110 @@ void gst_log(GstDebugCategory * category,
 }
 
 bool GStreamer::initialize(int argc, char* argv[]) {
+    gint64 start = g_get_monotonic_time();
+    bool rebuild = false;
+    for (int i = 1; i < argc; i++) {
+        rebuild |= g_strcmp0(argv[i], "--rebuild-registry") == 0;
+    }
+    registryWarm = setupRegistry(rebuild);
+
+    // Plugins are scanned in-process instead of through a forked gst-plugin-scanner
+    gst_registry_fork_set_enabled(FALSE);
+
     GError* gerror = nullptr;
     if (!gst_init_check(&argc, &argv, &gerror)) {
         fatal("GStreamer") << "Init check failed: " << gerror->message;
         g_error_free(gerror);
         return false;
     }
-    gst_init(&argc, &argv);
+
+    if (!registryWarm) {
+        saveRegistryStamp();
+    }
+    info("GStreamer") << "Initialized in " << (g_get_monotonic_time() - start) / 1000 << " ms, "
+                      << (registryWarm ? "warm" : "rebuilt") << " registry";
     return true;
 }
 
+bool GStreamer::setupRegistry(bool rebuild) {
+#ifdef GST_PLUGINS_DIR
+    if (g_getenv("GST_REGISTRY_1_0") || g_getenv("GST_PLUGIN_SYSTEM_PATH_1_0")) {
+        info("GStreamer") << "Registry set by the environment, not using the private one";
+        return true;
+    }
+
+    gchar *dir = g_build_filename(g_get_user_cache_dir(), "kabegami", nullptr);
+    registryDir = dir;
+    g_free(dir);
+
+    // The system plugin path becomes a directory of links to the whitelisted plugins only
+    std::string plugins = registryDir + "/plugins";
+    if (g_mkdir_with_parents(plugins.data(), 0755) != 0) {
+        warning("GStreamer") << "Failed to create " << plugins << ", using the system registry";
+        registryDir.clear();
+        return true;
+    }
+
+    registryFingerprint.clear();
+    for (const char* name : PLUGIN_WHITELIST) {
+        std::string file = std::string("libgst") + name + ".so";
+        std::string target = std::string(GST_PLUGINS_DIR) + "/" + file;
+        std::string link = plugins + "/" + file;
+
+        // Always made again, a link left over from another GST_PLUGINS_DIR must not keep pointing there
+        g_unlink(link.data());
+        GStatBuf stat;
+        if (g_stat(target.data(), &stat) != 0) {
+            continue;
+        }
+        registryFingerprint += file + " " + std::to_string(stat.st_mtime) + " " + std::to_string(stat.st_size) + "\n";
+        if (symlink(target.data(), link.data()) != 0) {
+            warning("GStreamer") << "Failed to link " << target;
+        }
+    }
+
+    std::string registry = registryDir + "/registry.bin";
+    g_setenv("GST_REGISTRY_1_0", registry.data(), TRUE);
+    g_setenv("GST_PLUGIN_SYSTEM_PATH_1_0", plugins.data(), TRUE);
+
+    // Unchanged plugins since the last scan: load the binary registry without stat'ing every plugin
+    gchar *stamp = nullptr;
+    std::string stampPath = registryDir + "/registry.stamp";
+    if (rebuild) {
+        // Nothing of the old registry survives, a broken cache file can not be merged into the new one
+        g_unlink(registry.data());
+        g_unlink(stampPath.data());
+    }
+    bool warm = !rebuild && g_file_test(registry.data(), G_FILE_TEST_EXISTS) &&
+                g_file_get_contents(stampPath.data(), &stamp, nullptr, nullptr) && registryFingerprint == stamp;
+    g_free(stamp);
+
+    if (warm && !g_getenv("GST_REGISTRY_UPDATE")) {
+        g_setenv("GST_REGISTRY_UPDATE", "no", TRUE);
+    }
+    return warm;
+#else
+    return true;
+#endif
+}
+
+void GStreamer::saveRegistryStamp() {
+    if (registryDir.empty()) {
+        return;
+    }
+
+    std::string stampPath = registryDir + "/registry.stamp";
+    GError *gerror = nullptr;
+    if (!g_file_set_contents(stampPath.data(), registryFingerprint.data(), -1, &gerror)) {
+        warning("GStreamer") << "Failed to write " << stampPath << ": " << gerror->message;
+        g_error_free(gerror);
+    }
+}
+
+bool GStreamer::isRegistryWarm() {
+    return registryWarm;
+}
+
 void GStreamer::enableDebug(int debuglevel) {
     if (debuglevel > 0) {
         gst_debug_set_default_threshold(static_cast<GstDebugLevel>(debuglevel));
@@ -86,7 +193,7 @@ void GStreamer::enableDebug(int debuglevel) {
     }
 }
 
-bool GStreamer::blacklist(DecoderType option) {
+bool GStreamer::changeRank(const char* featureName, guint rank) {
     GstRegistry* registry = gst_registry_get();
 
     if (registry == nullptr) {
@@ -94,22 +201,33 @@ bool GStreamer::blacklist(DecoderType option) {
         return false;
     }
 
-    auto changeRank = [registry](const char* featureName, uint16_t rank) {
-        GstPluginFeature* feature = gst_registry_lookup_feature(registry, featureName);
-        if (feature == nullptr) {
-            error("GStreamer") << "Failed to change ranking of feature. Featuer does not exist: " << featureName;
-            return false;
-        }
+    GstPluginFeature* feature = gst_registry_lookup_feature(registry, featureName);
+    if (feature == nullptr) {
+        error("GStreamer") << "Failed to change ranking of feature. Featuer does not exist: " << featureName;
+        return false;
+    }
 
-        gst_plugin_feature_set_rank(feature, rank);
-        gst_registry_add_feature(registry, feature);
-        gst_object_unref(feature);
-        return true;
-    };
+    gst_plugin_feature_set_rank(feature, rank);
+    gst_registry_add_feature(registry, feature);
+    gst_object_unref(feature);
+    return true;
+}
 
+guint GStreamer::getRank(const char* featureName) {
+    GstPluginFeature* feature = gst_registry_lookup_feature(gst_registry_get(), featureName);
+    if (feature == nullptr) {
+        return GST_RANK_NONE;
+    }
+    guint rank = gst_plugin_feature_get_rank(feature);
+    gst_object_unref(feature);
+    return rank;
+}
+
+bool GStreamer::blacklist(DecoderType option) {
     bool black = false;
     switch (option) {
     case Default:
+    case AutoBench:
         break;
     case Software:
         for (auto name : { "avdec_h264", "avdec_h265" }) {
@@ -0,0 +1,208 @@
+/*
+ * File name: MemorySource.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "MemorySource.h"
+#include <gst/base/gstbasesrc.h>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "KLoggeg.h"
+
+struct Mapping {
+    guint8* data = nullptr;
+    gsize size = 0;
+    bool mapped = false;
+    bool locked = false;
+
+    ~Mapping() {
+        if (locked) {
+            munlock(data, size);
+        }
+        if (mapped) {
+            munmap(data, size);
+        } else {
+            g_free(data);
+        }
+    }
+};
+
+typedef struct {
+    GstBaseSrc parent;
+    std::shared_ptr<Mapping>* mapping;
+} KabegamiMemSrc;
+
+typedef struct {
+    GstBaseSrcClass parent_class;
+} KabegamiMemSrcClass;
+
+G_DEFINE_TYPE(KabegamiMemSrc, kabegami_mem_src, GST_TYPE_BASE_SRC)
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+static KabegamiMemSrc* toMemSrc(gpointer object) {
+    return reinterpret_cast<KabegamiMemSrc*>(object);
+}
+
+static void releaseMapping(gpointer data) {
+    delete static_cast<std::shared_ptr<Mapping>*>(data);
+}
+
+static gboolean memSrcIsSeekable(GstBaseSrc *src) {
+    return TRUE;
+}
+
+static gboolean memSrcGetSize(GstBaseSrc *src, guint64 *size) {
+    *size = (*toMemSrc(src)->mapping)->size;
+    return TRUE;
+}
+
+static GstFlowReturn memSrcCreate(GstBaseSrc *src, guint64 offset, guint size, GstBuffer **buf) {
+    std::shared_ptr<Mapping>& mapping = *toMemSrc(src)->mapping;
+    if (offset >= mapping->size) {
+        return GST_FLOW_EOS;
+    }
+
+    gsize length = MIN(static_cast<gsize>(size), mapping->size - offset);
+
+    // Each buffer holds a reference to the mapping, so it outlives the element if needed
+    *buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, mapping->data, mapping->size,
+                                       offset, length, new std::shared_ptr<Mapping>(mapping), releaseMapping);
+    GST_BUFFER_OFFSET(*buf) = offset;
+    GST_BUFFER_OFFSET_END(*buf) = offset + length;
+    return GST_FLOW_OK;
+}
+
+static void memSrcFinalize(GObject *object) {
+    KabegamiMemSrc *src = toMemSrc(object);
+    delete src->mapping;
+    src->mapping = nullptr;
+    G_OBJECT_CLASS(kabegami_mem_src_parent_class)->finalize(object);
+}
+
+static void kabegami_mem_src_class_init(KabegamiMemSrcClass *klass) {
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+    GstBaseSrcClass *basesrc_class = GST_BASE_SRC_CLASS(klass);
+
+    gobject_class->finalize = memSrcFinalize;
+
+    gst_element_class_add_static_pad_template(element_class, &src_template);
+    gst_element_class_set_static_metadata(element_class, "Kabegami memory source", "Source/File",
+                                          "Serves a file from a memory mapping", "ToshibaMastru");
+
+    basesrc_class->is_seekable = memSrcIsSeekable;
+    basesrc_class->get_size = memSrcGetSize;
+    basesrc_class->create = memSrcCreate;
+}
+
+static void kabegami_mem_src_init(KabegamiMemSrc *src) {
+    src->mapping = nullptr;
+    gst_base_src_set_format(GST_BASE_SRC(src), GST_FORMAT_BYTES);
+    gst_base_src_set_blocksize(GST_BASE_SRC(src), 1 << 20);
+}
+
+static std::shared_ptr<Mapping> loadFile(const VideoSettings& settings) {
+    int fd = open(settings.filename.data(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error("MemorySource") << "Failed to open " << settings.filename;
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        error("MemorySource") << "Failed to stat " << settings.filename;
+        close(fd);
+        return nullptr;
+    }
+
+    auto mapping = std::make_shared<Mapping>();
+    mapping->size = st.st_size;
+
+    SourceType source = settings.source;
+    if (source == Memory && mapping->size > settings.memoryLimit * 1024 * 1024) {
+        warning("MemorySource") << "File exceeds memory limit of " << settings.memoryLimit << " MiB, using MMap";
+        source = MMap;
+    }
+
+    if (source == Memory) {
+        mapping->data = static_cast<guint8*>(g_try_malloc(mapping->size));
+        gsize done = 0;
+        while (mapping->data && done < mapping->size) {
+            ssize_t n = read(fd, mapping->data + done, mapping->size - done);
+            if (n <= 0) {
+                error("MemorySource") << "Failed to read " << settings.filename;
+                close(fd);
+                return nullptr;
+            }
+            done += n;
+        }
+    } else {
+        int flags = MAP_PRIVATE | (settings.mmapPopulate ? MAP_POPULATE : 0);
+        void* data = mmap(nullptr, mapping->size, PROT_READ, flags, fd, 0);
+        if (data != MAP_FAILED) {
+            mapping->data = static_cast<guint8*>(data);
+            mapping->mapped = true;
+            madvise(data, mapping->size, MADV_WILLNEED);
+        }
+    }
+    close(fd);
+
+    if (!mapping->data) {
+        error("MemorySource") << "Failed to load " << settings.filename << " into memory";
+        return nullptr;
+    }
+
+    if (settings.mmapLock) {
+        mapping->locked = (mlock(mapping->data, mapping->size) == 0);
+        if (!mapping->locked) {
+            warning("MemorySource") << "Failed to lock " << mapping->size << " bytes, check RLIMIT_MEMLOCK";
+        }
+    }
+
+    info("MemorySource") << (mapping->mapped ? "Mapped " : "Loaded ") << mapping->size << " bytes";
+    return mapping;
+}
+
+GstElement* MemorySource::create(const VideoSettings& settings) {
+    std::shared_ptr<Mapping> mapping = loadFile(settings);
+    if (!mapping) {
+        return nullptr;
+    }
+
+    GstElement *element = GST_ELEMENT(g_object_new(kabegami_mem_src_get_type(), nullptr));
+    toMemSrc(element)->mapping = new std::shared_ptr<Mapping>(mapping);
+    return element;
+}
+
+IOCounters MemorySource::getIOCounters() {
+    IOCounters counters;
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    guint64 value;
+    while (io >> key >> value) {
+        // rchar counts every read() including the X connection, only read_bytes says the disk was touched
+        if (key == "read_bytes:") {
+            counters.readBytes = value;
+        }
+    }
+    return counters;
+}
@@ -0,0 +1,472 @@
+/*
+ * File name: OverlayLayer.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "OverlayLayer.h"
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+#include <glib/gstdio.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include "Simd.h"
+#include "KLoggeg.h"
+
+static const int TILE_SIZE = 32;
+static const guint UPDATE_INTERVAL = 1; // s
+static const GstClockTime RASTER_TIMEOUT = 5 * GST_SECOND;
+static const GstClockTime POLL_INTERVAL = 50 * GST_MSECOND; // between bus checks while waiting for a raster
+
+// textrender sizes its output to the text when downstream allows it, the rest is cropped afterwards
+static const char* TEXT_PIPELINE =
+    "appsrc name=src format=time caps=\"text/x-raw,format=utf8\" ! "
+    "textrender font-desc=\"Sans Bold %u\" halignment=left valignment=top ! "
+    "videoconvert ! video/x-raw,format=BGRA ! appsink name=sink sync=false";
+static const char* IMAGE_PIPELINE =
+    "filesrc name=src ! decodebin ! videoconvert ! video/x-raw,format=BGRA ! appsink name=sink sync=false";
+
+OverlayLayer::OverlayLayer(const std::vector<std::string>& specs, guint fontSize)
+    : specs(specs), fontSize(fontSize), timer(0), stopping(false), textPipeline(nullptr), textSource(nullptr),
+      textSink(nullptr), textTime(0), scene(std::make_shared<Scene>()), rasterizations(0), frames(0), blendTime(0) {}
+
+OverlayLayer::~OverlayLayer() {
+    if (timer) {
+        g_source_remove(timer);
+    }
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobCondition.notify_one();
+        worker.join();
+    }
+    stopTextPipeline();
+}
+
+bool OverlayLayer::init() {
+    bool text = false;
+    for (const auto& spec : specs) {
+        OverlayWidget widget;
+        if (!parse(spec, widget)) {
+            return false;
+        }
+        text |= widget.kind != ImageWidget;
+        widgets.push_back(widget);
+    }
+
+    // Built up front so a missing textrender fails here instead of on every change
+    if (text && !startTextPipeline()) {
+        return false;
+    }
+
+    worker = std::thread(&OverlayLayer::run, this);
+    update();
+    timer = g_timeout_add_seconds(UPDATE_INTERVAL, onUpdate, this);
+    info("OverlayLayer") << widgets.size() << " widgets";
+    return true;
+}
+
+bool OverlayLayer::parse(const std::string& spec, OverlayWidget& widget) {
+    // kind[:argument][@x,y], the argument may contain ':' itself (clock formats do)
+    std::string body = spec;
+    size_t at = spec.rfind('@');
+    if (at != std::string::npos) {
+        body = spec.substr(0, at);
+        std::string position = spec.substr(at + 1);
+        size_t comma = position.find(',');
+        if (comma == std::string::npos ||
+            !parseOffset(position.substr(0, comma), widget.x, widget.fromRight) ||
+            !parseOffset(position.substr(comma + 1), widget.y, widget.fromBottom)) {
+            error("OverlayLayer") << "Invalid widget position, expected @X,Y: " << spec;
+            return false;
+        }
+    }
+
+    size_t colon = body.find(':');
+    std::string kind = body.substr(0, colon);
+    widget.argument = colon == std::string::npos ? "" : body.substr(colon + 1);
+
+    if (kind == "clock") {
+        widget.kind = ClockWidget;
+        if (widget.argument.empty()) {
+            widget.argument = "%H:%M";
+        }
+        return true;
+    }
+    if (kind == "hostname") {
+        widget.kind = HostnameWidget;
+        return true;
+    }
+
+    if (kind == "text") {
+        widget.kind = TextWidget;
+    } else if (kind == "image") {
+        widget.kind = ImageWidget;
+    } else if (kind == "file") {
+        widget.kind = FileWidget;
+    } else {
+        error("OverlayLayer") << "Unknown widget " << kind << ", expected clock, text, hostname, image or file";
+        return false;
+    }
+    if (widget.argument.empty()) {
+        error("OverlayLayer") << "Widget " << kind << " needs an argument: " << spec;
+        return false;
+    }
+    return true;
+}
+
+bool OverlayLayer::parseOffset(const std::string& text, int& offset, bool& fromEnd) {
+    // The sign is kept apart from the number, otherwise -0 would be the same as 0
+    fromEnd = !text.empty() && text[0] == '-';
+    const char *digits = text.data() + (fromEnd ? 1 : 0);
+    if (!g_ascii_isdigit(*digits)) {
+        return false;
+    }
+    char *end = nullptr;
+    errno = 0;
+    long value = strtol(digits, &end, 10);
+    if (errno != 0 || *end != '\0' || value > G_MAXINT) {
+        return false;
+    }
+    offset = static_cast<int>(value);
+    return true;
+}
+
+gboolean OverlayLayer::onUpdate(gpointer data) {
+    static_cast<OverlayLayer*>(data)->update();
+    return G_SOURCE_CONTINUE;
+}
+
+std::string OverlayLayer::currentContent(const OverlayWidget& widget) const {
+    switch (widget.kind) {
+        case ClockWidget: {
+            GDateTime *now = g_date_time_new_now_local();
+            gchar *text = g_date_time_format(now, widget.argument.data());
+            std::string content = text ? text : "";
+            g_free(text);
+            g_date_time_unref(now);
+            return content;
+        }
+        case TextWidget:
+            return widget.argument;
+        case HostnameWidget:
+            return g_get_host_name();
+        case ImageWidget:
+        case FileWidget: {
+            // Only the modification time is checked every second, the file is read when it changes
+            GStatBuf st;
+            if (g_stat(widget.argument.data(), &st) != 0) {
+                return "";
+            }
+            return std::to_string(st.st_mtime) + ":" + std::to_string(st.st_size);
+        }
+    }
+    return "";
+}
+
+void OverlayLayer::update() {
+    // Only the cheap content check runs on the main loop, the worker renders what changed
+    std::lock_guard<std::mutex> lock(jobMutex);
+    for (size_t i = 0; i < widgets.size(); i++) {
+        std::string content = currentContent(widgets[i]);
+        if (content == widgets[i].content) {
+            continue;
+        }
+        widgets[i].content = content;
+        jobs[i] = content; // a job still waiting for the same widget is superseded
+    }
+    if (!jobs.empty()) {
+        jobCondition.notify_one();
+    }
+}
+
+void OverlayLayer::run() {
+    std::unique_lock<std::mutex> lock(jobMutex);
+    while (true) {
+        jobCondition.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (stopping) {
+            return;
+        }
+        std::map<size_t, std::string> batch;
+        batch.swap(jobs);
+        lock.unlock();
+
+        for (const auto& [index, content] : batch) {
+            widgets[index].raster = rasterize(widgets[index], content);
+            rasterizations++;
+        }
+
+        auto next = std::make_shared<Scene>();
+        for (const auto& widget : widgets) {
+            if (widget.raster) {
+                next->push_back({widget.x, widget.y, widget.fromRight, widget.fromBottom, widget.raster});
+            }
+        }
+        {
+            std::lock_guard<std::mutex> sceneLock(mutex);
+            scene = next;
+        }
+        lock.lock();
+    }
+}
+
+std::shared_ptr<const OverlayRaster> OverlayLayer::rasterize(const OverlayWidget& widget, const std::string& content) {
+    if (content.empty()) {
+        return nullptr;
+    }
+    if (widget.kind == ImageWidget) {
+        return rasterizeImage(widget.argument);
+    }
+    if (widget.kind == FileWidget) {
+        gchar *text = nullptr;
+        std::shared_ptr<const OverlayRaster> raster;
+        if (g_file_get_contents(widget.argument.data(), &text, nullptr, nullptr)) {
+            raster = rasterizeText(g_strchomp(text));
+        }
+        g_free(text);
+        return raster;
+    }
+    return rasterizeText(content);
+}
+
+bool OverlayLayer::startTextPipeline() {
+    gchar *description = g_strdup_printf(TEXT_PIPELINE, fontSize);
+    GError *err = nullptr;
+    textPipeline = gst_parse_launch(description, &err);
+    g_free(description);
+    if (!textPipeline) {
+        error("OverlayLayer") << "Text rendering is not available: " << (err ? err->message : "unknown error");
+        g_clear_error(&err);
+        return false;
+    }
+    g_clear_error(&err);
+
+    textSource = gst_bin_get_by_name(GST_BIN(textPipeline), "src");
+    textSink = gst_bin_get_by_name(GST_BIN(textPipeline), "sink");
+    textTime = 0;
+    if (gst_element_set_state(textPipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        error("OverlayLayer") << "Text pipeline could not be started";
+        stopTextPipeline();
+        return false;
+    }
+    return true;
+}
+
+void OverlayLayer::stopTextPipeline() {
+    if (!textPipeline) {
+        return;
+    }
+    gst_element_set_state(textPipeline, GST_STATE_NULL);
+    gst_object_unref(textSource);
+    gst_object_unref(textSink);
+    gst_object_unref(textPipeline);
+    textPipeline = textSource = textSink = nullptr;
+}
+
+std::shared_ptr<const OverlayRaster> OverlayLayer::rasterizeText(const std::string& text) {
+    if (text.empty() || (!textPipeline && !startTextPipeline())) {
+        return nullptr;
+    }
+
+    // Every text is one more second of the same stream, textrender renders each buffer into one frame
+    GstBuffer *buffer = gst_buffer_new_memdup(text.data(), text.size());
+    GST_BUFFER_PTS(buffer) = textTime;
+    GST_BUFFER_DURATION(buffer) = GST_SECOND;
+    textTime += GST_SECOND;
+    gst_app_src_push_buffer(GST_APP_SRC(textSource), buffer);
+
+    GstSample *sample = pullSample(textPipeline, textSink);
+    if (!sample) {
+        stopTextPipeline(); // started again for the next text
+        return nullptr;
+    }
+    auto raster = createRaster(sample);
+    gst_sample_unref(sample);
+    return raster;
+}
+
+std::shared_ptr<const OverlayRaster> OverlayLayer::rasterizeImage(const std::string& path) {
+    GError *err = nullptr;
+    GstElement *pipeline = gst_parse_launch(IMAGE_PIPELINE, &err);
+    if (!pipeline) {
+        error("OverlayLayer") << "Image decoding is not available: " << (err ? err->message : "unknown error");
+        g_clear_error(&err);
+        return nullptr;
+    }
+    g_clear_error(&err);
+
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    g_object_set(G_OBJECT(src), "location", path.data(), NULL);
+    gst_object_unref(src);
+
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstSample *sample = pullSample(pipeline, sink);
+    std::shared_ptr<const OverlayRaster> raster;
+    if (sample) {
+        raster = createRaster(sample);
+        gst_sample_unref(sample);
+    }
+
+    gst_object_unref(sink);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return raster;
+}
+
+GstSample* OverlayLayer::pullSample(GstElement* pipeline, GstElement* sink) {
+    // Waits in short slices and checks the bus in between, a failed decode or an empty file ends the wait.
+    // Popping also drops the other messages, the text pipeline is never watched by a main loop.
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstSample *sample = nullptr;
+    bool failed = false;
+    for (GstClockTime waited = 0; !sample && !failed && waited < RASTER_TIMEOUT; waited += POLL_INTERVAL) {
+        sample = gst_app_sink_try_pull_sample(GST_APP_SINK(sink), POLL_INTERVAL);
+        GstMessage *msg = gst_bus_pop_filtered(bus, static_cast<GstMessageType>(GST_MESSAGE_ERROR | GST_MESSAGE_EOS));
+        if (!msg) {
+            continue;
+        }
+        // With a frame out already, the next push finds out whether the pipeline still works
+        if (!sample && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+            GError *err = nullptr;
+            gst_message_parse_error(msg, &err, nullptr);
+            error("OverlayLayer") << "Widget could not be rasterized: " << err->message;
+            g_clear_error(&err);
+        } else if (!sample) {
+            error("OverlayLayer") << "Widget could not be rasterized: no frame before the end of the stream";
+        }
+        failed = !sample;
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+
+    if (!sample && !failed) {
+        error("OverlayLayer") << "Widget could not be rasterized within " << RASTER_TIMEOUT / GST_SECOND << " s";
+    }
+    return sample;
+}
+
+std::shared_ptr<const OverlayRaster> OverlayLayer::createRaster(GstSample* sample) {
+    std::shared_ptr<OverlayRaster> raster;
+    GstVideoInfo videoInfo;
+    GstVideoFrame frame;
+    if (gst_video_info_from_caps(&videoInfo, gst_sample_get_caps(sample)) &&
+        gst_video_frame_map(&frame, &videoInfo, gst_sample_get_buffer(sample), GST_MAP_READ)) {
+        const guint8 *data = static_cast<const guint8*>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0));
+        int stride = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0);
+        int width = GST_VIDEO_FRAME_WIDTH(&frame);
+        int height = GST_VIDEO_FRAME_HEIGHT(&frame);
+
+        // Crop to the visible pixels, rendered text comes with a lot of transparent margin
+        int left = width, top = height, right = -1, bottom = -1;
+        for (int y = 0; y < height; y++) {
+            const guint8 *row = data + y * stride;
+            for (int x = 0; x < width; x++) {
+                if (row[x * 4 + 3]) {
+                    left = MIN(left, x);
+                    right = MAX(right, x);
+                    top = MIN(top, y);
+                    bottom = y;
+                }
+            }
+        }
+
+        if (right >= 0) {
+            raster = std::make_shared<OverlayRaster>();
+            raster->width = right - left + 1;
+            raster->height = bottom - top + 1;
+            raster->pixels.resize(static_cast<size_t>(raster->width) * raster->height);
+            for (int y = 0; y < raster->height; y++) {
+                const guint8 *row = data + (top + y) * stride + left * 4;
+                uint32_t *out = raster->pixels.data() + static_cast<size_t>(y) * raster->width;
+                for (int x = 0; x < raster->width; x++) {
+                    const guint8 *p = row + x * 4;
+                    guint a = p[3];
+                    out[x] = (a << 24) | ((p[2] * a + 127) / 255) << 16 | ((p[1] * a + 127) / 255) << 8 |
+                             ((p[0] * a + 127) / 255);
+                }
+            }
+
+            for (int ty = 0; ty < raster->height; ty += TILE_SIZE) {
+                for (int tx = 0; tx < raster->width; tx += TILE_SIZE) {
+                    OverlayTile tile = { tx, ty, MIN(TILE_SIZE, raster->width - tx), MIN(TILE_SIZE, raster->height - ty),
+                                         true };
+                    bool visible = false;
+                    for (int y = ty; y < ty + tile.height; y++) {
+                        for (int x = tx; x < tx + tile.width; x++) {
+                            guint a = raster->pixels[static_cast<size_t>(y) * raster->width + x] >> 24;
+                            visible |= a != 0;
+                            tile.opaque &= a == 255;
+                        }
+                    }
+                    if (visible) {
+                        raster->tiles.push_back(tile);
+                    }
+                }
+            }
+        }
+        gst_video_frame_unmap(&frame);
+    } else {
+        error("OverlayLayer") << "Widget could not be rasterized: unexpected raster format";
+    }
+    return raster;
+}
+
+void OverlayLayer::blend(guint8* data, int stride, int width, int height) {
+    GstClockTime start = gst_util_get_timestamp();
+    std::shared_ptr<const Scene> current;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = scene;
+    }
+
+    for (const auto& placement : *current) {
+        const OverlayRaster& raster = *placement.raster;
+        int ox = placement.fromRight ? width - placement.x - raster.width : placement.x;
+        int oy = placement.fromBottom ? height - placement.y - raster.height : placement.y;
+
+        for (const auto& tile : raster.tiles) {
+            int x0 = MAX(ox + tile.x, 0), x1 = MIN(ox + tile.x + tile.width, width);
+            int y0 = MAX(oy + tile.y, 0), y1 = MIN(oy + tile.y + tile.height, height);
+            if (x0 >= x1 || y0 >= y1) {
+                continue;
+            }
+            for (int y = y0; y < y1; y++) {
+                const uint32_t *src = raster.pixels.data() + static_cast<size_t>(y - oy) * raster.width + (x0 - ox);
+                uint32_t *dst = reinterpret_cast<uint32_t*>(data + y * stride) + x0;
+                if (tile.opaque) {
+                    std::memcpy(dst, src, (x1 - x0) * 4);
+                } else {
+                    Simd::blendPremultiplied(src, dst, x1 - x0);
+                }
+            }
+        }
+    }
+
+    blendTime += gst_util_get_timestamp() - start;
+    frames++;
+}
+
+void OverlayLayer::report() const {
+    guint64 blended = frames.load();
+    info("OverlayLayer") << widgets.size() << " widgets, " << rasterizations << " rasterizations, "
+                         << (blended ? blendTime.load() / 1000.0 / blended : 0.0) << " us blend per frame over "
+                         << blended << " frames";
+}
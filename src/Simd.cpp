@@ -0,0 +1,157 @@
+/*
+ * File name: Simd.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "Simd.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+#ifdef SIMD_X86
+static bool hasAVX2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+__attribute__((target("avx2")))
+static size_t equalAVX2(const uint8_t* a, const uint8_t* b, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1) {
+            return SIZE_MAX;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static size_t equalSSE2(const uint8_t* a, const uint8_t* b, size_t length) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+            return SIZE_MAX;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t expandPaletteAVX2(const uint8_t* indices, const uint32_t* palette, uint32_t* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices + i));
+        __m256i colors = _mm256_i32gather_epi32(reinterpret_cast<const int*>(palette), _mm256_cvtepu8_epi32(bytes), 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), colors);
+    }
+    return i;
+}
+
+// Scales the 16-bit channels by the inverse alpha of the matching source pixel, rounded like / 255
+__attribute__((target("sse2")))
+static inline __m128i scaleSSE2(__m128i dst, __m128i src) {
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(dst, _mm_sub_epi16(_mm_set1_epi16(255), alpha)), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static size_t blendSSE2(const uint32_t* src, uint32_t* dst, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i lo = scaleSSE2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero));
+        __m128i hi = scaleSSE2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i scaleAVX2(__m256i dst, __m256i src) {
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(dst, _mm256_sub_epi16(_mm256_set1_epi16(255), alpha)),
+                                 _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static size_t blendAVX2(const uint32_t* src, uint32_t* dst, size_t count) {
+    // Unpack and pack both stay within 128-bit lanes, so pixels come back in their own places
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i lo = scaleAVX2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero));
+        __m256i hi = scaleAVX2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)));
+    }
+    return i;
+}
+#endif
+
+void Simd::blendPremultiplied(const uint32_t* src, uint32_t* dst, size_t count) {
+    size_t done = 0;
+#ifdef SIMD_X86
+    done = hasAVX2() ? blendAVX2(src, dst, count) : blendSSE2(src, dst, count);
+#endif
+    for (size_t i = done; i < count; i++) {
+        uint32_t s = src[i], d = dst[i];
+        uint32_t inverse = 255 - (s >> 24);
+        uint32_t out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t t = ((d >> shift) & 0xFF) * inverse + 128;
+            out |= std::min(((s >> shift) & 0xFF) + ((t + (t >> 8)) >> 8), 255u) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+void Simd::expandPalette(const uint8_t* indices, const uint32_t* palette, uint32_t* out, size_t count) {
+    size_t done = 0;
+#ifdef SIMD_X86
+    // SSE2 has no gather, the scalar loop is as fast there
+    if (hasAVX2()) {
+        done = expandPaletteAVX2(indices, palette, out, count);
+    }
+#endif
+    for (size_t i = done; i < count; i++) {
+        out[i] = palette[indices[i]];
+    }
+}
+
+bool Simd::equal(const uint8_t* a, const uint8_t* b, size_t length) {
+    size_t done = 0;
+#ifdef SIMD_X86
+    done = hasAVX2() ? equalAVX2(a, b, length) : equalSSE2(a, b, length);
+    if (done == SIZE_MAX) {
+        return false;
+    }
+#endif
+    return std::memcmp(a + done, b + done, length - done) == 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * File name: SoakMonitor.cpp
+ * Author: ToshibaMastru
+ * Copyright (c) 2024 ToshibaMastru
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "SoakMonitor.h"
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include "KLoggeg.h"
+
+static const guint64 MAX_SAMPLES = 200;
+static const double WARMUP_FRACTION = 0.2;
+
+struct SoakMetric {
+    const char *name;
+    double SoakSample::*field;
+    double minimumGrowth; // absolute growth below this is noise, whatever the percentage
+};
+
+static const SoakMetric METRICS[] = {
+    {"rss (KiB)", &SoakSample::rss, 1024},
+    {"open fds", &SoakSample::fds, 1},
+    {"threads", &SoakSample::threads, 1},
+    {"live GstBuffers", &SoakSample::buffers, 1},
+    {"live GstObjects", &SoakSample::objects, 1},
+    {"loop time (ms)", &SoakSample::loopTime, 1},
+};
+
+SoakMonitor::SoakMonitor(guint64 loops, double threshold)
+    : loops(loops), completed(0), interval(MAX(loops / MAX_SAMPLES, 1)), threshold(threshold),
+      tracer(nullptr), batchStart(g_get_monotonic_time()) {}
+
+SoakMonitor::~SoakMonitor() {
+    if (tracer) {
+        gst_object_unref(tracer);
+    }
+}
+
+bool SoakMonitor::init() {
+    // The tracing hooks can be registered after gst_init, objects created before this are not counted
+    GstPluginFeature *feature = gst_registry_find_feature(gst_registry_get(), "leaks", GST_TYPE_TRACER_FACTORY);
+    if (feature) {
+        GstPluginFeature *loaded = gst_plugin_feature_load(feature);
+        if (loaded) {
+            GType type = gst_tracer_factory_get_tracer_type(GST_TRACER_FACTORY(loaded));
+            // Parsed as a structure field, unquoted the comma would end the filter list after GstBuffer
+            tracer = GST_TRACER(g_object_new(type, "params", "filters=\"GstBuffer,GstObject\"", NULL));
+            gst_object_ref_sink(tracer);
+            gst_object_unref(loaded);
+        }
+        gst_object_unref(feature);
+    }
+
+    if (!tracer) {
+        warning("SoakMonitor") << "leaks tracer is not available, live GstBuffer/GstObject counts are not tracked";
+    }
+
+    info("SoakMonitor") << "Soaking for " << loops << " loops, sampling every " << interval;
+    return true;
+}
+
+bool SoakMonitor::onLoop() {
+    completed++;
+    if (completed % interval == 0) {
+        gint64 now = g_get_monotonic_time();
+        samples.push_back(sample(static_cast<double>(now - batchStart) / interval / 1000.0));
+        batchStart = now;
+    }
+    return completed < loops;
+}
+
+SoakSample SoakMonitor::sample(double loopTime) const {
+    SoakSample sample = {};
+    sample.loopTime = loopTime;
+
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0, resident = 0;
+    statm >> pages >> resident;
+    sample.rss = resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("Threads:", 0) == 0) {
+            sample.threads = std::stod(line.substr(8));
+        }
+    }
+
+    GDir *dir = g_dir_open("/proc/self/fd", 0, nullptr);
+    if (dir) {
+        while (g_dir_read_name(dir)) {
+            sample.fds++;
+        }
+        g_dir_close(dir);
+    }
+
+    countLiveObjects(sample.buffers, sample.objects);
+    return sample;
+}
+
+void SoakMonitor::countLiveObjects(double& buffers, double& objects) const {
+    buffers = objects = -1;
+    if (!tracer) {
+        return;
+    }
+
+    GstStructure *live = nullptr;
+    g_signal_emit_by_name(tracer, "get-live-objects", &live);
+    if (!live) {
+        return;
+    }
+
+    buffers = objects = 0;
+    const GValue *list = gst_structure_get_value(live, "live-objects-list");
+    for (guint i = 0; list && i < gst_value_list_get_size(list); i++) {
+        const GstStructure *entry = gst_value_get_structure(gst_value_list_get_value(list, i));
+        const GValue *object = entry ? gst_structure_get_value(entry, "object") : nullptr;
+        if (!object) {
+            continue;
+        }
+        if (G_VALUE_HOLDS(object, G_TYPE_OBJECT)) {
+            objects++;
+        } else if (G_VALUE_HOLDS(object, GST_TYPE_MINI_OBJECT) || G_VALUE_HOLDS(object, GST_TYPE_BUFFER)) {
+            GstMiniObject *mini = static_cast<GstMiniObject*>(g_value_get_boxed(object));
+            if (mini && GST_IS_BUFFER(mini)) {
+                buffers++;
+            }
+        }
+    }
+    gst_structure_free(live);
+}
+
+bool SoakMonitor::report() const {
+    size_t first = samples.size() * WARMUP_FRACTION;
+    size_t count = samples.size() - first;
+    if (count < 3) {
+        warning("SoakMonitor") << "Only " << count << " samples after warm-up, no trend can be computed";
+        return true;
+    }
+
+    bool passed = true;
+    info("SoakMonitor") << completed << " loops, " << count << " samples after warm-up";
+
+    for (const auto& metric : METRICS) {
+        // Least squares fit over the samples, growth is the fitted change across the whole run
+        double sumX = 0, sumY = 0, sumXY = 0, sumXX = 0;
+        bool tracked = true;
+        for (size_t i = 0; i < count; i++) {
+            double y = samples[first + i].*metric.field;
+            tracked &= (y >= 0);
+            sumX += i;
+            sumY += y;
+            sumXY += i * y;
+            sumXX += static_cast<double>(i) * i;
+        }
+        if (!tracked) {
+            continue;
+        }
+
+        double slope = (count * sumXY - sumX * sumY) / (count * sumXX - sumX * sumX);
+        double start = (sumY - slope * sumX) / count;
+        double growth = slope * (count - 1);
+        double percent = start > 0 ? 100.0 * growth / start : 0;
+        bool failed = growth >= metric.minimumGrowth && percent > threshold;
+
+        Logger::Level level = failed ? Logger::Level::Error : Logger::Level::Info;
+        CLIHandler::logger(level, "SoakMonitor") << metric.name << ": " << samples[first].*metric.field << " -> "
+                                                 << samples.back().*metric.field << ", trend "
+                                                 << (growth >= 0 ? "+" : "") << percent << "%"
+                                                 << (failed ? " FAILED" : "");
+        passed &= !failed;
+    }
+    return passed;
+}
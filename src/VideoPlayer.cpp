@@ -18,54 +18,182 @@
  */
 
 #include "VideoPlayer.h"
+#include <gst/app/gstappsink.h>
 #include <gst/video/videooverlay.h>
+#include <cstring>
+#include "AnimatedImage.h"
+#include "DamageSink.h"
+#include "FrameExporter.h"
+#include "FrameTracer.h"
 #include "GStreamer.h"
+#include "MemorySource.h"
+#include "OverlayLayer.h"
+#include "SoakMonitor.h"
 #include "KLoggeg.h"
 
-VideoPlayer::VideoPlayer(const VideoSettings& settings) : settings(settings), loop(GStreamer::getMainLoop()) {}
+static const guint WATCHDOG_INTERVAL = 500;               // ms
+static const gint64 STALL_TIMEOUT = 2 * G_USEC_PER_SEC;
+static const gint64 REATTACH_DELAY = 5 * G_USEC_PER_SEC;
+static const guint MAX_RECOVERIES = 5;                    // within RECOVERY_WINDOW before giving up
+static const gint64 RECOVERY_WINDOW = 60 * G_USEC_PER_SEC;
+
+struct BranchRemoval {
+    GstPad *teePad;
+    std::vector<GstElement*> elements;
+    std::shared_ptr<DamageSink> damage; // until the old appsink stops calling it
+};
+
+// Elements a failed attach created but never added to the pipeline
+static void unrefElements(std::initializer_list<GstElement*> elements) {
+    for (GstElement *element : elements) {
+        if (element) {
+            gst_object_unref(element);
+        }
+    }
+}
+
+VideoPlayer::VideoPlayer(const VideoSettings& settings)
+    : settings(settings), loop(GStreamer::getMainLoop()), pipeline(nullptr), demuxer(nullptr), decoder(nullptr),
+      videoPads(0), rate(1.0), slideshowStarted(false), lastKeyframe(GST_CLOCK_TIME_NONE),
+      spacingMeasured(false), firstBufferTime(0), lastFrameTime(0), watchdog(0), source(nullptr), converter(nullptr),
+      recovering(false), resumeRequested(false), section(0), recoveryStart(0), lastPosition(GST_CLOCK_TIME_NONE), failures(0),
+      attempts(0), recoveries(0), lastFailure(0), recoveryTime(0), longestRecovery(0) {}
 
 VideoPlayer::~VideoPlayer() {
     stop();
 }
 
 bool VideoPlayer::init() {
+    if (const char *format = AnimatedImage::unsupportedFormat(settings.filename)) {
+        fatal("VideoPlayer") << format << " images are not supported, convert " << settings.filename
+                             << " to GIF, PNG or a video";
+        return false;
+    }
+    bool animated = AnimatedImage::isAnimatedImage(settings.filename);
+    if (animated && settings.soakLoops) {
+        // Image loops wrap inside the feeder, no EOS ever reaches the soak monitor
+        fatal("VideoPlayer") << "--soak needs a video, image wallpapers do not loop through the pipeline";
+        return false;
+    }
+
+    if (settings.soakLoops) {
+        // Created first so the live object counts cover every element of the pipeline
+        soak = std::make_unique<SoakMonitor>(settings.soakLoops, settings.soakThreshold);
+        soak->init();
+    }
+
     pipeline = gst_pipeline_new("video-player");
-    GstElement *source = gst_element_factory_make("filesrc", nullptr);
-    GstElement *demuxer = gst_element_factory_make("qtdemux", nullptr);
-    GstElement *decoder = gst_element_factory_make("decodebin3", nullptr);
-    GstElement *converter = gst_element_factory_make("videoconvert", nullptr);
+    if (!initOverlay()) {
+        return false;
+    }
+    if (animated) {
+        return initAnimation();
+    }
+
+    if (settings.source == File) {
+        source = gst_element_factory_make("filesrc", nullptr);
+    } else {
+        source = MemorySource::create(settings);
+        loopIO = MemorySource::getIOCounters(); // the first loop is measured from the loaded file on
+    }
+    converter = gst_element_factory_make("videoconvert", nullptr);
+    GstElement *pacer = gst_element_factory_make("clocksync", nullptr);
     GstElement *tee = gst_element_factory_make("tee", "t");
 
-    if (!pipeline || !source || !demuxer || !decoder || !converter || !tee) {
+    if (!pipeline || !source || !converter || !pacer || !tee) {
         fatal("VideoPlayer") << "One element could not be created"; // 𓆏
         return false;
     }
 
-    gst_bin_add_many(GST_BIN(pipeline), source, demuxer, decoder, converter, tee, NULL);
+    gst_bin_add_many(GST_BIN(pipeline), source, converter, pacer, tee, NULL);
+
+    for (GstElement *element : { source, converter, pacer, tee }) {
+        FrameTracer::attach(element);
+    }
+
+    if (!addDecodeSection()) {
+        return false;
+    }
+
+    if (!gst_element_link_many(converter, pacer, tee, NULL)) {
+        fatal("VideoPlayer") << "Elements could not be linked";
+        return false;
+    }
+
+    // Branches never push back on the tee, the decoder is held to the clock here instead
+    g_object_set(G_OBJECT(pacer), "sync", settings.sync ? TRUE : FALSE, NULL);
+    g_object_set(G_OBJECT(tee), "allow-not-linked", TRUE, NULL);
+
+    GstPad *tee_pad = gst_element_get_static_pad(tee, "sink");
+    gst_pad_add_probe(tee_pad, GST_PAD_PROBE_TYPE_BUFFER, onTeeBuffer, this, nullptr);
+    gst_object_unref(tee_pad);
+
+    // The EOS a failing decode section sends after its error must not end playback for everyone
+    GstPad *converter_pad = gst_element_get_static_pad(converter, "sink");
+    gst_pad_add_probe(converter_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, onSectionEvent, this, nullptr);
+    gst_object_unref(converter_pad);
+
+    if (settings.source == File) {
+        g_object_set(G_OBJECT(source), "location", settings.filename.data(), NULL);
+    }
+
+    if (!settings.exportSocket.empty() && !addExporter()) {
+        return false;
+    }
+
+    addBusWatch();
+
+    GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+    gst_bus_set_sync_handler(bus, onBusSync, this, nullptr);
+    gst_object_unref(bus);
+    return true;
+}
+
+bool VideoPlayer::addDecodeSection() {
+    demuxer = gst_element_factory_make("qtdemux", nullptr);
+    decoder = gst_element_factory_make("decodebin3", nullptr);
+    if (!demuxer || !decoder) {
+        fatal("VideoPlayer") << "Demuxer or decoder could not be created";
+        return false;
+    }
+
+    gst_bin_add_many(GST_BIN(pipeline), demuxer, decoder, NULL);
+    FrameTracer::attach(demuxer);
+    FrameTracer::attach(decoder);
 
     if (!gst_element_link(source, demuxer)) {
         fatal("VideoPlayer") << "Source and Demuxer could not be linked";
         return false;
     }
 
-    g_signal_connect(demuxer, "pad-added", G_CALLBACK(onNewPad), decoder);
+    g_signal_connect(demuxer, "pad-added", G_CALLBACK(onDemuxerPad), this);
+    g_signal_connect(demuxer, "no-more-pads", G_CALLBACK(onDemuxerNoMorePads), this);
     g_signal_connect(decoder, "pad-added", G_CALLBACK(onNewPad), converter);
+    return true;
+}
 
-    if (!gst_element_link_many(converter, tee, NULL)) {
-        fatal("VideoPlayer") << "Elements could not be linked";
+bool VideoPlayer::initAnimation() {
+    // Each monitor gets its own source in attachBranch, there is nothing to demux or decode per loop
+    animation = std::make_unique<AnimatedImage>();
+    if (!pipeline || !animation->load(settings.filename, settings.memoryLimit)) {
+        fatal("VideoPlayer") << "Animated image could not be loaded";
         return false;
     }
+    if (!settings.exportSocket.empty()) {
+        warning("VideoPlayer") << "Frame export is not available for animated images";
+    }
 
-    g_object_set(G_OBJECT(source), "location", settings.filename.data(), NULL);
+    addBusWatch();
+    return true;
+}
 
+void VideoPlayer::addBusWatch() {
     GstBus *bus;
     if ((bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline))) != nullptr) {
         gst_bus_add_watch(bus, onBusMessage, this);
         gst_object_unref(bus);
         bus = nullptr;
     }
-
-    return true;
 }
 
 bool VideoPlayer::start() {
@@ -80,70 +208,478 @@ bool VideoPlayer::start() {
 }
 
 void VideoPlayer::stop() {
+    if (watchdog) {
+        g_source_remove(watchdog);
+        watchdog = 0;
+    }
     if (pipeline){
+        GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+        gst_bus_remove_watch(bus);
+        gst_bus_set_sync_handler(bus, nullptr, nullptr, nullptr);
+        gst_object_unref(bus);
+
+        reportBranches();
+        reportRecoveries();
+        if (overlay) {
+            overlay->report();
+        }
         gst_element_set_state(pipeline, GST_STATE_NULL);
         gst_object_unref(GST_OBJECT(pipeline));
         pipeline = nullptr;
+        branches.clear();
     }
 }
 
-bool VideoPlayer::addWindow(guintptr wid) {
-    GstElement *tee = gst_bin_get_by_name(GST_BIN(pipeline), "t");
-    if (tee == nullptr) {
-        fatal("VideoPlayer") << "Tee not found in pipeline";
+bool VideoPlayer::addWindow(guintptr wid, const MonitorInfo& monitor) {
+    auto branch = std::make_unique<Branch>();
+    branch->monitor = monitor;
+    branch->window = wid;
+    if (!attachBranch(*branch)) {
         return false;
     }
+    branches.push_back(std::move(branch));
 
-    GstElement *queue;
-    GstElement *sink;
-    std::string sink_name;
+    // Animation sources are pushed from memory, there is no shared tee for a branch to stall
+    if (!watchdog && !animation) {
+        watchdog = g_timeout_add(WATCHDOG_INTERVAL, onWatchdog, this);
+    }
+    return true;
+}
 
-    switch (settings.overlay) {
+const char* VideoPlayer::sinkFactory(OverlayType overlay) {
+    switch (overlay) {
         case X11:
-            sink_name = "xvimagesink";
-            sink = gst_element_factory_make("xvimagesink", nullptr);
-            break;
+            return "xvimagesink";
         case OpenGL:
-            sink_name = "glimagesink";
-            sink = gst_element_factory_make("glimagesink", nullptr);
-            break;
+            return "glimagesink";
         case Wayland:
-            sink_name = "waylandsink";
-            sink = gst_element_factory_make("waylandsink", nullptr);
-            break;
+            return "waylandsink";
         case DirectX:
-            sink_name = "d3dvideosink";
-            break;
+            return "d3dvideosink";
+        case XShm:
+            return "appsink";
+        case Offscreen:
+            return "fakesink";
         default:
-            fatal("VideoPlayer") << "Invalid video overlay option";
-            return false;
+            return nullptr;
     }
+}
 
-    queue = gst_element_factory_make("queue", nullptr);
-    sink = gst_element_factory_make(sink_name.data(), nullptr);
+bool VideoPlayer::setSinkDisplay(GstElement *sink, const MonitorInfo& monitor) {
+    // A window handle is only valid on its own display, the sink must not fall back to $DISPLAY.
+    // The first --display entry need not be $DISPLAY, so the name is always set when possible.
+    if (!monitor.display) {
+        return true;
+    }
+    const char *name = DisplayString(monitor.display);
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(sink), "display")) {
+        g_object_set(G_OBJECT(sink), "display", name, NULL);
+        return true;
+    }
+    if (g_strcmp0(g_getenv("DISPLAY"), name) == 0) {
+        return true;
+    }
+    fatal("VideoPlayer") << GST_OBJECT_NAME(gst_element_get_factory(sink)) << " can not be moved to " << name
+                         << ", use X11 or XShm for " << monitor.name;
+    return false;
+}
+
+bool VideoPlayer::attachBranch(Branch& branch) {
+    if (animation) {
+        return attachAnimationBranch(branch);
+    }
 
-    if (!sink) {
-        fatal("VideoPlayer") << "Failed to create a " << sink_name << " element";
+    const MonitorInfo& monitor = branch.monitor;
+    GstElement *tee = gst_bin_get_by_name(GST_BIN(pipeline), "t");
+    if (tee == nullptr) {
+        fatal("VideoPlayer") << "Tee not found in pipeline";
         return false;
     }
 
-    if (!queue) {
-        fatal("VideoPlayer") << "Failed to create a queue element";
+    GstElement *queue;
+    GstElement *sink;
+    const char *sink_name = sinkFactory(settings.overlay);
+
+    if (!sink_name) {
+        fatal("VideoPlayer") << "Invalid video overlay option";
+        gst_object_unref(tee);
         return false;
     }
 
-    g_object_set(G_OBJECT(queue), "max-size-buffers", 2, "max-size-time", 0, "max-size-bytes", 0, NULL);
+    queue = gst_element_factory_make("queue", nullptr);
+    sink = gst_element_factory_make(sink_name, nullptr);
+    GstElement *rate = gst_element_factory_make("videorate", nullptr);
 
-    gst_bin_add_many(GST_BIN(pipeline), queue, sink, NULL);
-    gst_element_link_many(tee, queue, sink, NULL);
+    if (!sink || !queue || !rate) {
+        fatal("VideoPlayer") << "Failed to create a " << (!sink ? sink_name : !queue ? "queue" : "videorate")
+                             << " element";
+        unrefElements({ queue, rate, sink, tee });
+        return false;
+    }
+
+    // Latest frame wins: a sink that falls behind loses old frames instead of holding back the tee
+    g_object_set(G_OBJECT(queue), "max-size-buffers", 1, "max-size-time", 0, "max-size-bytes", 0,
+                 "leaky", 2, NULL);
+    g_signal_connect(queue, "overrun", G_CALLBACK(onQueueOverrun), &branch);
 
-    gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), wid);
+    // Frames the monitor cannot show are dropped before they are scaled, converted or uploaded
+    g_object_set(G_OBJECT(rate), "drop-only", TRUE, NULL);
+    if (monitor.refreshRate > 0) {
+        g_object_set(G_OBJECT(rate), "max-rate", static_cast<gint>(monitor.refreshRate + 0.5), NULL);
+    }
+    if (!settings.sync) {
+        g_object_set(G_OBJECT(sink), "sync", FALSE, NULL);
+    }
 
+    if (settings.overlay == XShm || settings.overlay == Offscreen) {
+        // Scaling happens here since the damage path compares and uploads at monitor resolution.
+        // Offscreen branches do the same work and only skip the upload.
+        GstElement *scaler = gst_element_factory_make("videoscale", nullptr);
+        GstElement *converter = gst_element_factory_make("videoconvert", nullptr);
+        GstElement *filter = gst_element_factory_make("capsfilter", nullptr);
+        // A reattached branch keeps its X connection and shared image, only the elements are new
+        std::shared_ptr<DamageSink> damage = branch.damage;
+        if (settings.overlay == XShm && !damage) {
+            damage = std::make_shared<DamageSink>(monitor, branch.window, settings.tileSize);
+            if (!damage->init()) {
+                damage.reset();
+            }
+        }
+
+        if (!scaler || !converter || !filter || (settings.overlay == XShm && !damage)) {
+            fatal("VideoPlayer") << "Failed to create a damage branch for " << monitor.name;
+            unrefElements({ queue, rate, scaler, converter, filter, sink, tee });
+            return false;
+        }
+
+        GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                            "format", G_TYPE_STRING, "BGRx",
+                                            "width", G_TYPE_INT, monitor.width,
+                                            "height", G_TYPE_INT, monitor.height, NULL);
+        g_object_set(G_OBJECT(filter), "caps", caps, NULL);
+        gst_caps_unref(caps);
+
+        branch.elements = { queue, rate, scaler, converter, filter, sink };
+        if (damage) {
+            damage->attach(GST_APP_SINK(sink));
+            branch.damage = damage;
+        }
+    } else {
+        if (!setSinkDisplay(sink, monitor)) {
+            unrefElements({ queue, rate, sink, tee });
+            return false;
+        }
+        branch.elements = { queue, rate, sink };
+        gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), branch.window);
+    }
+
+    GstElement *previous = tee;
+    for (GstElement *element : branch.elements) {
+        gst_bin_add(GST_BIN(pipeline), element);
+        FrameTracer::attach(element);
+        gst_element_link(previous, element);
+        previous = element;
+    }
+
+    GstPad *queue_pad = gst_element_get_static_pad(queue, "sink");
+    branch.teePad = gst_pad_get_peer(queue_pad);
+    gst_object_unref(queue_pad);
+
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, onBranchBuffer, &branch, nullptr);
+    gst_object_unref(sink_pad);
+    addOverlay(sink);
+
+    branch.rate = rate;
+    branch.lastFrame = g_get_monotonic_time();
+    branch.detachedAt = 0;
+
+    // Sinks first, so a reattached branch is ready before the tee pushes into it
+    for (auto it = branch.elements.rbegin(); it != branch.elements.rend(); ++it) {
+        gst_element_sync_state_with_parent(*it);
+    }
+
+    gst_object_unref(tee);
     tee = queue = sink = nullptr;
 
     return true;
 }
 
+bool VideoPlayer::attachAnimationBranch(Branch& branch) {
+    // Frames come out of the frame table already at the monitor size, no scaling follows.
+    // Only the appsink takes BGRx as is, the other sinks get a converter to negotiate their own format.
+    const char *sink_name = sinkFactory(settings.overlay);
+    bool appsink = settings.overlay == XShm || settings.overlay == Offscreen;
+    GstElement *source = animation->createSource(branch.monitor, settings.loop);
+    GstElement *converter = appsink ? nullptr : gst_element_factory_make("videoconvert", nullptr);
+    GstElement *sink = sink_name ? gst_element_factory_make(sink_name, nullptr) : nullptr;
+    if (!source || !sink || (!appsink && !converter)) {
+        fatal("VideoPlayer") << "Failed to create an animation branch for " << branch.monitor.name;
+        unrefElements({ source, converter, sink });
+        return false;
+    }
+
+    if (!settings.sync) {
+        g_object_set(G_OBJECT(sink), "sync", FALSE, NULL);
+    }
+
+    if (settings.overlay == XShm) {
+        auto damage = std::make_shared<DamageSink>(branch.monitor, branch.window, settings.tileSize);
+        if (!damage->init()) {
+            fatal("VideoPlayer") << "Failed to create a damage branch for " << branch.monitor.name;
+            unrefElements({ source, sink });
+            return false;
+        }
+        damage->attach(GST_APP_SINK(sink));
+        branch.damage = damage;
+    } else if (!appsink) {
+        if (!setSinkDisplay(sink, branch.monitor)) {
+            unrefElements({ source, converter, sink });
+            return false;
+        }
+        gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), branch.window);
+    }
+
+    if (appsink) {
+        branch.elements = { source, sink };
+        gst_bin_add_many(GST_BIN(pipeline), source, sink, NULL);
+        gst_element_link(source, sink);
+    } else {
+        branch.elements = { source, converter, sink };
+        gst_bin_add_many(GST_BIN(pipeline), source, converter, sink, NULL);
+        gst_element_link_many(source, converter, sink, NULL);
+    }
+    FrameTracer::attach(source);
+    FrameTracer::attach(sink);
+
+    GstPad *source_pad = gst_element_get_static_pad(source, "src");
+    gst_pad_add_probe(source_pad, GST_PAD_PROBE_TYPE_BUFFER, onTeeBuffer, this, nullptr);
+    gst_object_unref(source_pad);
+    addOverlay(sink);
+    return true;
+}
+
+bool VideoPlayer::initOverlay() {
+    if (settings.widgets.empty()) {
+        return true;
+    }
+    if (settings.overlay != XShm && settings.overlay != Offscreen) {
+        warning("VideoPlayer") << "Widgets are only drawn with -o XShm or -o Offscreen";
+        return true;
+    }
+    overlay = std::make_unique<OverlayLayer>(settings.widgets, settings.widgetFontSize);
+    return overlay->init();
+}
+
+void VideoPlayer::addOverlay(GstElement *sink) {
+    // Without widgets there is no probe at all, frames go to the sink untouched
+    if (!overlay) {
+        return;
+    }
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, onOverlayBuffer, this, nullptr);
+    gst_object_unref(sink_pad);
+}
+
+GstPadProbeReturn VideoPlayer::onOverlayBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    GstVideoInfo videoInfo;
+    bool valid = caps && gst_video_info_from_caps(&videoInfo, caps);
+    if (caps) {
+        gst_caps_unref(caps);
+    }
+    if (!valid) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    // Branch buffers come fresh out of the branch converter and are blended in place, only a
+    // passthrough buffer still shared with the tee gets copied here
+    GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+    GST_PAD_PROBE_INFO_DATA(info) = buffer;
+
+    GstVideoFrame frame;
+    if (gst_video_frame_map(&frame, &videoInfo, buffer, GST_MAP_WRITE)) {
+        player->overlay->blend(static_cast<guint8*>(GST_VIDEO_FRAME_PLANE_DATA(&frame, 0)),
+                               GST_VIDEO_FRAME_PLANE_STRIDE(&frame, 0), GST_VIDEO_FRAME_WIDTH(&frame),
+                               GST_VIDEO_FRAME_HEIGHT(&frame));
+        gst_video_frame_unmap(&frame);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+void VideoPlayer::detachBranch(Branch& branch) {
+    guint64 in = 0, paced = 0;
+    g_object_get(G_OBJECT(branch.rate), "in", &in, "drop", &paced, NULL);
+    branch.framesIn += in;
+    branch.paced += paced;
+
+    // The stuck sink may never return from its state change, so teardown happens on a GStreamer thread
+    auto *removal = new BranchRemoval{ branch.teePad, branch.elements, branch.damage };
+    for (GstElement *element : removal->elements) {
+        gst_object_ref(element);
+    }
+    gst_pad_add_probe(branch.teePad, GST_PAD_PROBE_TYPE_IDLE, onBranchIdle, removal, nullptr);
+
+    branch.teePad = nullptr;
+    branch.rate = nullptr;
+    branch.elements.clear();
+    branch.detaches++;
+    branch.detachedAt = g_get_monotonic_time();
+    warning("VideoPlayer") << branch.monitor.name << ": branch stalled, detached (" << branch.detaches << " times)";
+}
+
+GstPadProbeReturn VideoPlayer::onBranchIdle(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    BranchRemoval *removal = static_cast<BranchRemoval*>(data);
+    GstPad *queue_pad = gst_element_get_static_pad(removal->elements.front(), "sink");
+    gst_pad_unlink(pad, queue_pad);
+    gst_object_unref(queue_pad);
+
+    GstElement *pipeline = GST_ELEMENT(gst_element_get_parent(removal->elements.front()));
+    gst_element_call_async(pipeline, onRemoveBranch, removal, nullptr);
+    gst_object_unref(pipeline);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+void VideoPlayer::onRemoveBranch(GstElement *pipeline, gpointer data) {
+    BranchRemoval *removal = static_cast<BranchRemoval*>(data);
+    GstElement *tee = GST_ELEMENT(gst_pad_get_parent(removal->teePad));
+    gst_element_release_request_pad(tee, removal->teePad);
+    gst_object_unref(removal->teePad);
+    gst_object_unref(tee);
+
+    for (GstElement *element : removal->elements) {
+        gst_element_set_state(element, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), element);
+        gst_object_unref(element);
+    }
+    delete removal;
+}
+
+void VideoPlayer::onQueueOverrun(GstElement *queue, gpointer data) {
+    static_cast<Branch*>(data)->dropped++;
+}
+
+GstPadProbeReturn VideoPlayer::onBranchBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    static_cast<Branch*>(data)->lastFrame = g_get_monotonic_time();
+    return GST_PAD_PROBE_OK;
+}
+
+gboolean VideoPlayer::onWatchdog(gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    gint64 now = g_get_monotonic_time();
+    gint64 lastFrame = player->lastFrameTime.load();
+
+    for (auto& branch : player->branches) {
+        if (!branch->teePad) {
+            // Back off up to 80 s for an output that keeps getting stuck
+            gint64 delay = REATTACH_DELAY << MIN(branch->detaches - 1, 4u);
+            if (now - branch->detachedAt <= delay) {
+                continue;
+            }
+            if (player->attachBranch(*branch)) {
+                info("VideoPlayer") << branch->monitor.name << ": branch reattached";
+            } else {
+                branch->detachedAt = now;
+            }
+        } else if (lastFrame - branch->lastFrame.load() > STALL_TIMEOUT) {
+            // The tee kept producing while this sink took nothing
+            player->detachBranch(*branch);
+        }
+    }
+    player->restoreDecoders();
+    return G_SOURCE_CONTINUE;
+}
+
+void VideoPlayer::reportBranches() {
+    for (const auto& branch : branches) {
+        guint64 in = branch->framesIn, paced = branch->paced;
+        if (branch->rate) {
+            guint64 rateIn = 0, rateDropped = 0;
+            g_object_get(G_OBJECT(branch->rate), "in", &rateIn, "drop", &rateDropped, NULL);
+            in += rateIn;
+            paced += rateDropped;
+        }
+        info("VideoPlayer") << branch->monitor.name << ": " << paced << " of " << in << " frames dropped for "
+                            << branch->monitor.refreshRate << " Hz, " << branch->dropped.load()
+                            << " dropped by the queue, " << branch->detaches << " detaches";
+    }
+}
+
+bool VideoPlayer::addExporter() {
+    GstElement *tee = gst_bin_get_by_name(GST_BIN(pipeline), "t");
+    GstElement *queue = gst_element_factory_make("queue", nullptr);
+    GstElement *scaler = gst_element_factory_make("videoscale", nullptr);
+    GstElement *converter = gst_element_factory_make("videoconvert", nullptr);
+    GstElement *filter = gst_element_factory_make("capsfilter", nullptr);
+    GstElement *sink = gst_element_factory_make("appsink", nullptr);
+    exporter = std::make_unique<FrameExporter>(settings.exportSocket);
+
+    if (!tee || !queue || !scaler || !converter || !filter || !sink || !exporter->init()) {
+        fatal("VideoPlayer") << "Failed to create the frame export branch";
+        return false;
+    }
+
+    // A slow exporter only loses frames, it never holds the tee back
+    g_object_set(G_OBJECT(queue), "max-size-buffers", 1, "max-size-time", 0, "max-size-bytes", 0,
+                 "leaky", 2, NULL);
+
+    GstCaps *caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "BGRx", NULL);
+    if (settings.exportWidth > 0 && settings.exportHeight > 0) {
+        gst_caps_set_simple(caps, "width", G_TYPE_INT, settings.exportWidth,
+                                  "height", G_TYPE_INT, settings.exportHeight, NULL);
+    }
+    g_object_set(G_OBJECT(filter), "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (!settings.sync) {
+        g_object_set(G_OBJECT(sink), "sync", FALSE, NULL);
+    }
+
+    gst_bin_add_many(GST_BIN(pipeline), queue, scaler, converter, filter, sink, NULL);
+    for (GstElement *element : { queue, scaler, converter, filter, sink }) {
+        FrameTracer::attach(element);
+    }
+    gst_element_link_many(tee, queue, scaler, converter, filter, sink, NULL);
+    gst_object_unref(tee);
+
+    exporter->attach(GST_APP_SINK(sink));
+    return true;
+}
+
+gint64 VideoPlayer::getFirstBufferTime() const {
+    return firstBufferTime.load();
+}
+
+bool VideoPlayer::reportSoak() const {
+    return !soak || soak->report();
+}
+
+GstPadProbeReturn VideoPlayer::onTeeBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    if (player->recovering) {
+        // A rebuilt section starts from the beginning, its frames are held back until it is back at the old position
+        bool requested = false;
+        if (player->resumeRequested.compare_exchange_strong(requested, true)) {
+            // Tagged with the section, a message from a section that failed meanwhile must not resume playback
+            gst_element_post_message(player->pipeline, gst_message_new_application(GST_OBJECT(pad),
+                                     gst_structure_new("section-ready", "section", G_TYPE_UINT,
+                                                       player->section.load(), NULL)));
+        }
+        return GST_PAD_PROBE_DROP;
+    }
+
+    GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+    if (GST_CLOCK_TIME_IS_VALID(pts)) {
+        player->lastPosition = pts;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    gint64 none = 0;
+    player->firstBufferTime.compare_exchange_strong(none, now);
+    player->lastFrameTime = now;
+    return GST_PAD_PROBE_OK;
+}
+
 void VideoPlayer::onNewPad(GstElement *element, GstPad *pad, GstElement *data) {
     GstPad *sink_pad = gst_element_get_static_pad(data, "sink");
     if (gst_pad_is_linked(sink_pad)) {
@@ -156,25 +692,311 @@ void VideoPlayer::onNewPad(GstElement *element, GstPad *pad, GstElement *data) {
     g_object_unref(sink_pad);
 }
 
+void VideoPlayer::onDemuxerPad(GstElement *element, GstPad *pad, gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    gchar *name = gst_pad_get_name(pad);
+    bool selected = g_str_has_prefix(name, "video_") && player->videoPads++ == player->settings.videoTrack;
+
+    if (selected) {
+        if (player->settings.slideshowInterval) {
+            gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, onKeyframe, player, nullptr);
+        }
+        onNewPad(element, pad, player->decoder);
+    } else {
+        // Unselected tracks are dropped right at the demuxer and never reach a parser or decoder
+        gst_pad_add_probe(pad, static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          onDropBuffer, nullptr, nullptr);
+        log("VideoPlayer") << "Dropping stream " << name;
+    }
+    g_free(name);
+}
+
+void VideoPlayer::onDemuxerNoMorePads(GstElement *element, gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    if (player->videoPads > player->settings.videoTrack) {
+        return;
+    }
+
+    // Posted by the pipeline, not the demuxer, so it is not mistaken for a recoverable decode failure
+    GError *err = g_error_new(GST_STREAM_ERROR, GST_STREAM_ERROR_WRONG_TYPE,
+                              "Video track %u not found, %s has %u video tracks", player->settings.videoTrack,
+                              player->settings.filename.data(), player->videoPads);
+    gst_element_post_message(player->pipeline, gst_message_new_error(GST_OBJECT(player->pipeline), err, nullptr));
+    g_error_free(err);
+}
+
+GstPadProbeReturn VideoPlayer::onDropBuffer(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    return GST_PAD_PROBE_DROP;
+}
+
+GstPadProbeReturn VideoPlayer::onKeyframe(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    // Not every demuxer honours key-unit trick mode, delta frames are stopped here either way
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        return GST_PAD_PROBE_DROP;
+    }
+
+    GstClockTime pts = GST_BUFFER_PTS(buffer);
+    if (player->spacingMeasured) {
+        return GST_PAD_PROBE_OK;
+    }
+    if (GST_CLOCK_TIME_IS_VALID(player->lastKeyframe) && GST_CLOCK_TIME_IS_VALID(pts) && pts > player->lastKeyframe) {
+        // The playback rate is picked on the main loop once the distance between two keyframes is known
+        GstStructure *spacing = gst_structure_new("keyframe-spacing", "spacing", G_TYPE_UINT64,
+                                                  pts - player->lastKeyframe, NULL);
+        gst_element_post_message(player->pipeline, gst_message_new_application(GST_OBJECT(pad), spacing));
+        player->spacingMeasured = true;
+    } else {
+        player->lastKeyframe = pts;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+bool VideoPlayer::seek(gint64 position, GstSeekFlags extra) {
+    // Loops keep the slideshow flags and rate, a plain seek would go back to decoding every frame
+    GstSeekFlags flags = static_cast<GstSeekFlags>(GST_SEEK_FLAG_FLUSH | extra);
+    if (settings.slideshowInterval) {
+        flags = static_cast<GstSeekFlags>(flags | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_TRICKMODE |
+                                          GST_SEEK_FLAG_TRICKMODE_KEY_UNITS | GST_SEEK_FLAG_TRICKMODE_NO_AUDIO);
+    }
+    return gst_element_seek(pipeline, rate, GST_FORMAT_TIME, flags, GST_SEEK_TYPE_SET, position,
+                            GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+}
+
+GstPadProbeReturn VideoPlayer::onSectionEvent(GstPad *pad, GstPadProbeInfo *info, gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_EOS && player->recovering) {
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static std::string decoderFactoryName(GstObject *object, GstObject *decodebin) {
+    std::string name;
+    gst_object_ref(object);
+    while (object && object != decodebin) {
+        GstElementFactory *factory = GST_IS_ELEMENT(object) ? gst_element_get_factory(GST_ELEMENT(object)) : nullptr;
+        const gchar *klass = factory ? gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS) : nullptr;
+        if (klass && strstr(klass, "Decoder")) {
+            name = GST_OBJECT_NAME(factory);
+            break;
+        }
+        GstObject *parent = gst_object_get_parent(object);
+        gst_object_unref(object);
+        object = parent;
+    }
+    if (object) {
+        gst_object_unref(object);
+    }
+    return name;
+}
+
+GstBusSyncReply VideoPlayer::onBusSync(GstBus *bus, GstMessage *msg, gpointer data) {
+    VideoPlayer *player = static_cast<VideoPlayer*>(data);
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_ERROR) {
+        return GST_BUS_PASS;
+    }
+
+    // Runs in the failing streaming thread, before the element gets to push EOS downstream
+    std::lock_guard<std::mutex> lock(player->recoveryMutex);
+    GstObject *src = GST_MESSAGE_SRC(msg);
+    if (!player->decoder ||
+        (src != GST_OBJECT(player->demuxer) && !gst_object_has_as_ancestor(src, GST_OBJECT(player->decoder)))) {
+        return GST_BUS_PASS;
+    }
+
+    if (!player->recovering) {
+        player->recovering = true;
+        player->recoveryStart = g_get_monotonic_time();
+    }
+    if (player->failedDecoder.empty()) {
+        player->failedDecoder = decoderFactoryName(src, GST_OBJECT(player->decoder));
+    }
+    return GST_BUS_PASS;
+}
+
+bool VideoPlayer::recover() {
+    gint64 now = g_get_monotonic_time();
+    if (now - lastFailure > RECOVERY_WINDOW) {
+        attempts = 0;
+    }
+    lastFailure = now;
+    failures++;
+    if (++attempts > MAX_RECOVERIES) {
+        error("VideoPlayer") << "Decoding failed " << MAX_RECOVERIES << " times in a row, giving up";
+        return false;
+    }
+
+    // Windows, branches and the converter stay, only what sits between the source and the converter is replaced.
+    // Not under the lock: stopping joins streaming threads that may be waiting in onBusSync
+    for (GstElement *element : { demuxer, decoder }) {
+        gst_element_set_state(element, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), element);
+    }
+    gst_element_set_state(source, GST_STATE_READY);
+    videoPads = 0;
+    lastKeyframe = GST_CLOCK_TIME_NONE;
+    section++; // the old section is stopped, whatever it still posted is stale now
+    resumeRequested = false;
+
+    std::string failed;
+    {
+        std::lock_guard<std::mutex> lock(recoveryMutex);
+        failed.swap(failedDecoder);
+        if (!addDecodeSection()) {
+            return false;
+        }
+    }
+
+    // decodebin3 plugs the next decoder by rank, so the failed one is ranked out of the way until
+    // the replacement has played through a whole RECOVERY_WINDOW
+    if (!failed.empty() && !demotedDecoders.contains(failed)) {
+        guint rank = GStreamer::getRank(failed.data());
+        if (GStreamer::changeRank(failed.data(), GST_RANK_NONE)) {
+            demotedDecoders[failed] = rank;
+            warning("VideoPlayer") << failed << " failed, falling back to the next decoder";
+        }
+    }
+
+    for (GstElement *element : { source, demuxer, decoder }) {
+        gst_element_sync_state_with_parent(element);
+    }
+
+    info("VideoPlayer") << "Decode section rebuilt, attempt " << attempts << " of " << MAX_RECOVERIES;
+    return true;
+}
+
+void VideoPlayer::resume() {
+    // Accurate so the decoder skips ahead to the exact frame instead of replaying from the keyframe
+    GstClockTime position = lastPosition;
+    if (GST_CLOCK_TIME_IS_VALID(position)) {
+        seek(position, GST_SEEK_FLAG_ACCURATE);
+    }
+
+    gint64 elapsed = g_get_monotonic_time() - recoveryStart;
+    recoveries++;
+    recoveryTime += elapsed;
+    longestRecovery = MAX(longestRecovery, elapsed);
+    recovering = false;
+
+    info("VideoPlayer") << "Playback resumed at " << (GST_CLOCK_TIME_IS_VALID(position) ? position / GST_MSECOND : 0)
+                        << " ms, " << elapsed / 1000 << " ms after the failure";
+}
+
+void VideoPlayer::restoreDecoders() {
+    // The rank is process wide, a one-off failure must not keep the decoder out for good
+    if (demotedDecoders.empty() || recovering || g_get_monotonic_time() - lastFailure <= RECOVERY_WINDOW) {
+        return;
+    }
+    for (const auto& [name, rank] : demotedDecoders) {
+        GStreamer::changeRank(name.data(), rank);
+        info("VideoPlayer") << name << " restored to rank " << rank;
+    }
+    demotedDecoders.clear();
+}
+
+void VideoPlayer::reportRecoveries() {
+    if (!failures) {
+        return;
+    }
+    info("VideoPlayer") << failures << " decode failures, " << recoveries << " recoveries, time to recovery "
+                        << (recoveries ? recoveryTime / recoveries / 1000 : 0) << " ms mean, "
+                        << longestRecovery / 1000 << " ms max";
+}
+
+void VideoPlayer::setKeyframeSpacing(GstClockTime spacing) {
+    gdouble wanted = CLAMP(static_cast<gdouble>(spacing) / (settings.slideshowInterval * GST_MSECOND), 0.01, 64.0);
+    info("VideoPlayer") << "Keyframes every " << spacing / GST_MSECOND << " ms, slideshow rate " << wanted;
+    if (wanted == rate) {
+        return;
+    }
+
+    gint64 position = 0;
+    gst_element_query_position(pipeline, GST_FORMAT_TIME, &position);
+    rate = wanted;
+    seek(position);
+}
+
 gboolean VideoPlayer::onBusMessage(GstBus *bus, GstMessage *msg, gpointer data) {
     VideoPlayer *player = static_cast<VideoPlayer*>(data);
     switch (GST_MESSAGE_TYPE(msg)) {
         case GST_MESSAGE_EOS: {
-            if (player->settings.loop) {
-                GstElement *pipeline = GST_ELEMENT(msg->src);
-                gst_element_seek_simple(pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH, 0);
+            if (player->recovering) {
+                break;
+            }
+            if (player->soak && !player->soak->onLoop()) {
+                g_main_loop_quit(player->loop);
+            } else if (player->settings.loop) {
+                player->seek(0);
+
+                if (player->settings.source != File) {
+                    IOCounters io = MemorySource::getIOCounters();
+                    log("VideoPlayer") << "Loop I/O: read_bytes +" << io.readBytes - player->loopIO.readBytes;
+                    player->loopIO = io;
+                }
             } else {
                 g_main_loop_quit(player->loop);
             }
             break;
         }
+        case GST_MESSAGE_ASYNC_DONE: {
+            // The first preroll switches to keyframes only, later ones come from our own seeks
+            if (player->settings.slideshowInterval && !player->slideshowStarted && !player->animation) {
+                player->slideshowStarted = true;
+                player->seek(0);
+            }
+            break;
+        }
+        case GST_MESSAGE_APPLICATION: {
+            const GstStructure *structure = gst_message_get_structure(msg);
+            guint64 spacing = 0;
+            if (gst_structure_has_name(structure, "keyframe-spacing") &&
+                gst_structure_get_uint64(structure, "spacing", &spacing)) {
+                player->setKeyframeSpacing(spacing);
+            } else if (gst_structure_has_name(structure, "section-ready") && player->recovering) {
+                guint tagged = 0;
+                if (gst_structure_get_uint(structure, "section", &tagged) && tagged == player->section) {
+                    player->resume();
+                }
+            }
+            break;
+        }
+        case GST_MESSAGE_STREAM_COLLECTION: {
+            // Track selection happens in onDemuxerPad, the decoder only ever sees the one linked pad
+            GstStreamCollection *collection = nullptr;
+            gst_message_parse_stream_collection(msg, &collection);
+            if (collection && GST_MESSAGE_SRC(msg) != GST_OBJECT(player->decoder)) {
+                info("VideoPlayer") << gst_stream_collection_get_size(collection) << " streams in file, using video track "
+                                    << player->settings.videoTrack;
+            }
+            if (collection) {
+                gst_object_unref(collection);
+            }
+            break;
+        }
         case GST_MESSAGE_ERROR: {
             GError *err;
             gchar *debug;
             gst_message_parse_error(msg, &err, &debug);
             g_free(debug);
-            error("VideoPlayer") << err->message;
+
+            // Elements of a section that was already replaced can still have errors queued up
+            GstObject *src = GST_MESSAGE_SRC(msg);
+            if (!gst_object_has_as_ancestor(src, GST_OBJECT(player->pipeline))) {
+                log("VideoPlayer") << "Ignoring error from a removed element: " << err->message;
+                g_error_free(err);
+                break;
+            }
+
+            bool recoverable = player->recovering;
+            CLIHandler::logger(recoverable ? Logger::Level::Warning : Logger::Level::Error, "VideoPlayer") << err->message;
             g_error_free(err);
+            if (recoverable && player->recover()) {
+                break;
+            }
             g_main_loop_quit(player->loop);
             player->stop();
             break;
@@ -19,7 +19,9 @@
 
 #include "XWPWindow.h"
 
-XWPWindow::XWPWindow() : win(None) {}
+std::map<Display*, WindowAtoms> XWPWindow::atoms;
+
+XWPWindow::XWPWindow() : display(nullptr), win(None) {}
 
 XWPWindow::~XWPWindow() {
     destroyWindow();
@@ -28,12 +30,12 @@ XWPWindow::~XWPWindow() {
 bool XWPWindow::createWindow(const MonitorInfo& monitorInfo) {
     destroyWindow();
 
-    Display* display = XrandrManager::getDisplay();
-    Window root = XrandrManager::getRoot();
+    display = monitorInfo.display ? monitorInfo.display : XrandrManager::getDisplay();
+    Window root = DefaultRootWindow(display);
+    const WindowAtoms& atom = getAtoms(display);
 
     XSetWindowAttributes attrs;
     attrs.event_mask = NoEventMask;
-    attrs.backing_store = NotUseful;
     attrs.save_under = False;
     attrs.backing_store = Always;
 
@@ -43,38 +45,23 @@ bool XWPWindow::createWindow(const MonitorInfo& monitorInfo) {
                         0, CopyFromParent, InputOutput,
                         CopyFromParent, CWBackingStore, &attrs);
 
-    Atom atom_below = XInternAtom(display, "_NET_WM_STATE_BELOW", False);
-    Atom atom_state = XInternAtom(display, "_NET_WM_STATE", False);
-    XChangeProperty(display, win, atom_state, XA_ATOM, 32, PropModeReplace, (unsigned char *)&atom_below, 1);
-
-    Atom atom_type = XInternAtom(display, "_NET_WM_WINDOW_TYPE", False);
-    Atom atom_desktop = XInternAtom(display, "_NET_WM_WINDOW_TYPE_DESKTOP", False);
-    XChangeProperty(display, win, atom_type, XA_ATOM, 32, PropModeReplace, (unsigned char *)&atom_desktop, 1);
-
-    Atom atom_hints = XInternAtom(display, "_MOTIF_WM_HINTS", True);
-    if (atom_hints != None) {
-        struct {
-            unsigned long flags;
-            unsigned long functions;
-            unsigned long decorations;
-            long input_mode;
-            unsigned long status;
-        } hints = {2, 0, 0, 0, 0};
-        XChangeProperty(display, win, atom_hints, atom_hints, 32, PropModeReplace, (unsigned char *)&hints, 5);
-    }
-
-    XSelectInput(display, win, NoEventMask);
+    Atom states[] = { atom.stateBelow, atom.stateSkipPager };
+    XChangeProperty(display, win, atom.state, XA_ATOM, 32, PropModeReplace, (unsigned char *)states, 2);
+    XChangeProperty(display, win, atom.windowType, XA_ATOM, 32, PropModeReplace, (unsigned char *)&atom.windowTypeDesktop, 1);
 
-    Atom atom_input = XInternAtom(display, "_NET_WM_STATE_SKIP_PAGER", False);
-    XChangeProperty(display, win, XInternAtom(display, "_NET_WM_STATE", False),
-                        XA_ATOM, 32, PropModeAppend, (unsigned char *)&atom_input, 1);
+    struct {
+        unsigned long flags;
+        unsigned long functions;
+        unsigned long decorations;
+        long input_mode;
+        unsigned long status;
+    } hints = {2, 0, 0, 0, 0};
+    XChangeProperty(display, win, atom.motifHints, atom.motifHints, 32, PropModeReplace, (unsigned char *)&hints, 5);
 
     XMapWindow(display, win);
     XLowerWindow(display, win);
 
-    // XFlush(display);
-    XSync(display, 0);
-
+    // Requests stay queued, the caller syncs once after every window is created
     return true;
 }
 
@@ -84,7 +71,35 @@ Window XWPWindow::getWindow() const {
 
 void XWPWindow::destroyWindow()  {
     if (win != None) {
-        XDestroyWindow(XrandrManager::getDisplay(), win);
+        XDestroyWindow(display, win);
         win = None;
     }
 }
+
+const WindowAtoms& XWPWindow::getAtoms(Display* display) {
+    auto it = atoms.find(display);
+    if (it != atoms.end()) {
+        return it->second;
+    }
+
+    // One round trip for all of them instead of one per XInternAtom call
+    char* names[] = {
+        const_cast<char*>("_NET_WM_STATE"),
+        const_cast<char*>("_NET_WM_STATE_BELOW"),
+        const_cast<char*>("_NET_WM_STATE_SKIP_PAGER"),
+        const_cast<char*>("_NET_WM_WINDOW_TYPE"),
+        const_cast<char*>("_NET_WM_WINDOW_TYPE_DESKTOP"),
+        const_cast<char*>("_MOTIF_WM_HINTS")
+    };
+    Atom values[6] = {};
+    XInternAtoms(display, names, 6, False, values);
+
+    WindowAtoms& atom = atoms[display];
+    atom.state = values[0];
+    atom.stateBelow = values[1];
+    atom.stateSkipPager = values[2];
+    atom.windowType = values[3];
+    atom.windowTypeDesktop = values[4];
+    atom.motifHints = values[5];
+    return atom;
+}
@@ -18,12 +18,80 @@
  */
 
 #include "XrandrManager.h"
+#include <X11/Xlib-xcb.h>
+#include <xcb/randr.h>
+#include <cstdio>
+#include <cstdlib>
 #include "KLoggeg.h"
 
 Display* XrandrManager::display = nullptr;
 Window XrandrManager::root = None;
+std::vector<XrandrManager::Connection> XrandrManager::connections;
+bool XrandrManager::fake = false;
 std::vector<MonitorInfo> XrandrManager::monitors;
 
+static double refreshRate(unsigned long dotClock, unsigned int hTotal, unsigned int vTotal, unsigned long flags) {
+    if (!hTotal || !vTotal) {
+        return 0;
+    }
+    double lines = vTotal;
+    if (flags & RR_DoubleScan) {
+        lines *= 2;
+    }
+    if (flags & RR_Interlace) {
+        lines /= 2;
+    }
+    return dotClock / (hTotal * lines);
+}
+
+static double modeRefreshRate(const XRRScreenResources* res, RRMode mode) {
+    for (int i = 0; i < res->nmode; i++) {
+        const XRRModeInfo& modeInfo = res->modes[i];
+        if (modeInfo.id == mode) {
+            return refreshRate(modeInfo.dotClock, modeInfo.hTotal, modeInfo.vTotal, modeInfo.modeFlags);
+        }
+    }
+    return 0;
+}
+
+// Every CRTC is queried in one batch, each reply names the outputs it drives and its mode. Xlib would
+// need an output and a CRTC round trip per monitor.
+static std::vector<xcb_randr_get_crtc_info_cookie_t> requestCrtcs(
+    xcb_connection_t* xcb, const xcb_randr_get_screen_resources_current_reply_t* res) {
+    const xcb_randr_crtc_t* crtcs = xcb_randr_get_screen_resources_current_crtcs(res);
+    std::vector<xcb_randr_get_crtc_info_cookie_t> cookies;
+    for (int i = 0; i < xcb_randr_get_screen_resources_current_crtcs_length(res); i++) {
+        cookies.push_back(xcb_randr_get_crtc_info(xcb, crtcs[i], res->config_timestamp));
+    }
+    return cookies;
+}
+
+static std::map<RROutput, double> crtcRefreshRates(xcb_connection_t* xcb,
+                                                   const xcb_randr_get_screen_resources_current_reply_t* res,
+                                                   const std::vector<xcb_randr_get_crtc_info_cookie_t>& cookies) {
+    const xcb_randr_mode_info_t* modes = xcb_randr_get_screen_resources_current_modes(res);
+    int modeCount = xcb_randr_get_screen_resources_current_modes_length(res);
+    std::map<RROutput, double> rates;
+    for (const auto& cookie : cookies) {
+        xcb_randr_get_crtc_info_reply_t* crtc = xcb_randr_get_crtc_info_reply(xcb, cookie, nullptr);
+        if (!crtc) {
+            continue;
+        }
+        double rate = 0;
+        for (int i = 0; i < modeCount; i++) {
+            if (modes[i].id == crtc->mode) {
+                rate = refreshRate(modes[i].dot_clock, modes[i].htotal, modes[i].vtotal, modes[i].mode_flags);
+            }
+        }
+        const xcb_randr_output_t* outputs = xcb_randr_get_crtc_info_outputs(crtc);
+        for (int i = 0; i < xcb_randr_get_crtc_info_outputs_length(crtc); i++) {
+            rates[outputs[i]] = rate;
+        }
+        free(crtc);
+    }
+    return rates;
+}
+
 int x_log(Display *display, XErrorEvent *xerror) {
     char errorText[256];
     XGetErrorText(display, xerror->error_code, errorText, sizeof(errorText));
@@ -31,23 +99,85 @@ int x_log(Display *display, XErrorEvent *xerror) {
     return 0;
 }
 
-bool XrandrManager::initialize() {
+bool XrandrManager::initialize(const std::string& fakeMonitors, const std::string& displayNames) {
     XSetErrorHandler(x_log);
-    display = XOpenDisplay(nullptr);
-    if (!display) {
-        fatal("XrandrManager") << "Failed to initialize";
+
+    // Without a list only $DISPLAY is used, each listed display gets its own connection
+    gchar **names = g_strsplit(displayNames.data(), ",", -1);
+    bool opened = *names ? true : openDisplay(nullptr);
+    for (gchar **name = names; opened && *name; name++) {
+        opened = openDisplay(**name ? *name : nullptr);
+    }
+    g_strfreev(names);
+    if (!opened) {
+        cleanup(); // the displays opened before the failing one
         return false;
     }
+
+    display = connections.front().display;
     root = DefaultRootWindow(display);
+
+    if (!fakeMonitors.empty()) {
+        // Windows still go to the first real display, only the layout comes from the command line
+        fake = parseLayout(fakeMonitors, monitors);
+        for (auto& monitor : monitors) {
+            monitor.display = display;
+        }
+        return fake;
+    }
+
     updateMonitorInfo();
     return true;
 }
 
+bool XrandrManager::openDisplay(const char* name) {
+    Display* connection = XOpenDisplay(name);
+    if (!connection) {
+        fatal("XrandrManager") << "Failed to open display " << (name ? name : "$DISPLAY");
+        return false;
+    }
+
+    int major = 0, minor = 0;
+    XRRQueryVersion(connection, &major, &minor);
+    connections.push_back({connection, major > 1 || (major == 1 && minor >= 5)});
+    return true;
+}
+
+bool XrandrManager::parseLayout(const std::string& layout, std::vector<MonitorInfo>& result) {
+    result.clear();
+    gchar **entries = g_strsplit(layout.data(), ",", -1);
+    bool valid = true;
+    for (gchar **entry = entries; *entry; entry++) {
+        MonitorInfo monitor;
+        monitor.refreshRate = 60;
+        // The whole entry has to be consumed, with or without the rate, so "1920x1080+0+0junk" is rejected
+        int consumed = -1;
+        int matched = sscanf(*entry, "%dx%d+%d+%d%n", &monitor.width, &monitor.height, &monitor.x, &monitor.y,
+                             &consumed);
+        if (matched == 4 && consumed >= 0 && (*entry)[consumed] == '@') {
+            int rateConsumed = -1;
+            sscanf(*entry + consumed, "@%lf%n", &monitor.refreshRate, &rateConsumed);
+            consumed = rateConsumed >= 0 && monitor.refreshRate > 0 ? consumed + rateConsumed : -1;
+        }
+        if (matched < 4 || consumed < 0 || (*entry)[consumed] != '\0' || monitor.width <= 0 || monitor.height <= 0) {
+            error("XrandrManager") << "Invalid monitor geometry, expected WxH+X+Y[@Hz]: " << *entry;
+            valid = false;
+            break;
+        }
+        monitor.name = "fake-" + std::to_string(result.size());
+        monitor.primary = result.empty();
+        result.push_back(monitor);
+    }
+    g_strfreev(entries);
+    return valid && !result.empty();
+}
+
 void XrandrManager::cleanup() {
-    if (display) {
-        XCloseDisplay(display);
-        display = nullptr;
+    for (const auto& connection : connections) {
+        XCloseDisplay(connection.display);
     }
+    connections.clear();
+    display = nullptr;
 }
 
 std::vector<MonitorInfo> XrandrManager::getMonitors() {
@@ -64,14 +194,98 @@ MonitorInfo XrandrManager::getPrimaryMonitor() {
 }
 
 void XrandrManager::updateMonitorInfo() {
+    if (fake) {
+        return;
+    }
     monitors.clear();
+    for (auto& connection : connections) {
+        if (connection.hasMonitors) {
+            updateFromMonitors(connection);
+        } else {
+            updateFromResources(connection.display);
+        }
+    }
+}
+
+void XrandrManager::sync() {
+    for (const auto& connection : connections) {
+        XSync(connection.display, False);
+    }
+}
 
-    XRRScreenResources* res = XRRGetScreenResources(display, root);
+void XrandrManager::updateFromMonitors(Connection& connection) {
+    Display* display = connection.display;
+    Window root = DefaultRootWindow(display);
+    int count = 0;
+    // Sent ahead of XRRGetMonitors, the resources reply arrives within that round trip
+    xcb_connection_t* xcb = XGetXCBConnection(display);
+    xcb_randr_get_screen_resources_current_cookie_t resourcesCookie =
+        xcb_randr_get_screen_resources_current(xcb, root);
+    XRRMonitorInfo* info = XRRGetMonitors(display, root, True, &count);
+    xcb_randr_get_screen_resources_current_reply_t* res =
+        xcb_randr_get_screen_resources_current_reply(xcb, resourcesCookie, nullptr);
+    if (!info) {
+        free(res);
+        return;
+    }
+
+    // A monitor refreshes at the mode of its first output. The CRTCs are only queried again once the
+    // server reports a new configuration, their replies arrive within the atom name round trip.
+    std::vector<xcb_randr_get_crtc_info_cookie_t> crtcCookies;
+    bool changed = res && res->timestamp != connection.resourcesTimestamp;
+    if (changed) {
+        crtcCookies = requestCrtcs(xcb, res);
+    }
+
+    // Names are resolved in a single batch instead of one XGetAtomName per monitor
+    std::vector<Atom> atoms(count);
+    std::vector<char*> names(count, nullptr);
+    for (int i = 0; i < count; i++) {
+        atoms[i] = info[i].name;
+    }
+    if (count > 0) {
+        XGetAtomNames(display, atoms.data(), count, names.data());
+    }
+
+    if (changed) {
+        connection.refreshRates = crtcRefreshRates(xcb, res, crtcCookies);
+        connection.resourcesTimestamp = res->timestamp;
+    }
+
+    for (int i = 0; i < count; i++) {
+        MonitorInfo monitor;
+        monitor.name = names[i] ? names[i] : "";
+        monitor.width = info[i].width;
+        monitor.height = info[i].height;
+        monitor.x = info[i].x;
+        monitor.y = info[i].y;
+        monitor.primary = info[i].primary;
+        monitor.display = display;
+        if (info[i].noutput > 0) {
+            auto rate = connection.refreshRates.find(info[i].outputs[0]);
+            if (rate != connection.refreshRates.end()) {
+                monitor.refreshRate = rate->second;
+            }
+        }
+
+        monitors.push_back(monitor);
+        XFree(names[i]);
+    }
+    free(res);
+    XRRFreeMonitors(info);
+}
+
+void XrandrManager::updateFromResources(Display* display) {
+    // The current resources are served from the server cache without reprobing the outputs
+    Window root = DefaultRootWindow(display);
+    XRRScreenResources* res = XRRGetScreenResourcesCurrent(display, root);
     if (!res) return;
 
+    RROutput primary = XRRGetOutputPrimary(display, root);
+
     for (int i = 0; i < res->noutput; i++) {
         XRROutputInfo* output_info = XRRGetOutputInfo(display, res, res->outputs[i]);
-        if (!output_info || output_info->connection != RR_Connected) {
+        if (!output_info || output_info->connection != RR_Connected || output_info->crtc == None) {
             XRRFreeOutputInfo(output_info);
             continue;
         }
@@ -84,7 +298,9 @@ void XrandrManager::updateMonitorInfo() {
             info.height = crtc_info->height;
             info.x = crtc_info->x;
             info.y = crtc_info->y;
-            info.primary = (XRRGetOutputPrimary(display, root) == res->outputs[i]);
+            info.primary = (primary == res->outputs[i]);
+            info.refreshRate = modeRefreshRate(res, crtc_info->mode);
+            info.display = display;
 
             monitors.push_back(info);
 
@@ -19,8 +19,10 @@
 
 #include "XWPWindow.h"
 #include "VideoPlayer.h"
+#include "DecoderBench.h"
 #include "GStreamer.h"
 #include "CLIHandler.h"
+#include "FrameTracer.h"
 #include "KLoggeg.h"
 #include <csignal>
 #include <cstdlib>
@@ -44,8 +46,8 @@ void signal_handler(int signal) {
 }
 
 int ProjectMain(int argc, char *argv[]) {
-    if (!GStreamer::initialize(argc, argv) ||
-        !XrandrManager::initialize()){
+    gint64 startTime = g_get_monotonic_time();
+    if (!GStreamer::initialize(argc, argv)) {
         return -1;
     }
 
@@ -61,25 +63,61 @@ int ProjectMain(int argc, char *argv[]) {
         return -1;
     }
 
+    if (settings.decoder == AutoBench) {
+        DecoderBench::select(settings.filename);
+    } else if (settings.decoder != Default) {
+        GStreamer::blacklist(settings.decoder);
+    }
+
+    // Offscreen output never opens a display, its monitors only come from the layout
+    bool offscreen = settings.overlay == Offscreen;
+    std::vector<MonitorInfo> monitors;
+    if (offscreen) {
+        if (!XrandrManager::parseLayout(settings.fakeMonitors.empty() ? "1920x1080+0+0" : settings.fakeMonitors,
+                                        monitors)) {
+            return -1;
+        }
+    } else if (!XrandrManager::initialize(settings.fakeMonitors, settings.displays)) {
+        return -1;
+    } else {
+        monitors = XrandrManager::getMonitors();
+    }
+
+    if (!settings.trace.empty()) {
+        FrameTracer::enable(settings.trace);
+    }
+
     VideoPlayer videoPlayer(settings);
     if (!videoPlayer.init()) {
         return -1;
     }
 
-    auto monitors = XrandrManager::getMonitors();
-    std::vector<std::unique_ptr<XWPWindow>> windows;
+    std::vector<std::unique_ptr<XWPWindow>> windows(monitors.size());
+
+    // All windows go out in one batch, sinks only see them after the single sync
+    if (!offscreen) {
+        for (size_t i = 0; i < monitors.size(); i++) {
+            windows[i] = std::make_unique<XWPWindow>();
+            if (!windows[i]->createWindow(monitors[i])) {
+                windows[i].reset();
+            }
+        }
+        XrandrManager::sync();
+    }
 
-    for (const auto& monitor : monitors) {
-        auto window = std::make_unique<XWPWindow>();
-        if (!window->createWindow(monitor) ||
-            !videoPlayer.addWindow(window->getWindow())) {
+    for (size_t i = 0; i < monitors.size(); i++) {
+        const auto& monitor = monitors[i];
+        guintptr wid = windows[i] ? windows[i]->getWindow() : 0;
+        if ((!offscreen && !windows[i]) || !videoPlayer.addWindow(wid, monitor)) {
             error("Main") << "Failed to create window: "
                           << monitor.name << ", resolution: " << monitor.width << "x" << monitor.height;
+            windows[i].reset();
             continue;
         }
 
-        windows.push_back(std::move(window));
-        info("XrandrManager") << "name: " << monitor.name << ", resolution: " << monitor.width << "x" << monitor.height;
+        info("XrandrManager") << "display: " << (monitor.display ? DisplayString(monitor.display) : "none")
+                              << ", name: " << monitor.name << ", resolution: " << monitor.width << "x" << monitor.height
+                              << ", refresh: " << monitor.refreshRate << " Hz";
     }
 
     if (!videoPlayer.start()) {
@@ -92,10 +130,15 @@ int ProjectMain(int argc, char *argv[]) {
         windows.clear();
     }
 
-    if (!videoPlayer.start()) {
-        videoPlayer.stop();
+    // Streaming threads must be gone before their trace buffers are read
+    videoPlayer.stop();
+    FrameTracer::write();
+
+    if (videoPlayer.getFirstBufferTime()) {
+        info("Main") << "First frame " << (videoPlayer.getFirstBufferTime() - startTime) / 1000 << " ms after start, "
+                     << (GStreamer::isRegistryWarm() ? "warm" : "cold") << " registry";
     }
-    return 0;
+    return videoPlayer.reportSoak() ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {